@@ -0,0 +1,293 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include "zstr.hpp"
+
+void usage(std::ostream& os, const std::string& prog_name)
+{
+    os << "Use: " << prog_name << " [-s size_mb] [-t threads] [-r rounds] [-d tmp_dir] [-n]" << std::endl
+       << "Synposis:" << std::endl
+       << "  Measure zstr compression and decompression throughput, in MB/s of uncompressed data," << std::endl
+       << "  on synthetic text and FASTQ-like data: gzip output across compression levels, buffer" << std::endl
+       << "  sizes and threads; text and gzip input across buffer sizes, with block, line and" << std::endl
+       << "  getline() reads; BGZF output and input, using the block codec backend zstr was" << std::endl
+       << "  compiled with; and the gzip and zcat programs, as baselines (unless -n is given)." << std::endl
+       << "  Input data is written to files in tmp_dir (default: /tmp), removed at the end." << std::endl
+       << "  Output is tab-separated: backend, operation, data, input, level, buffer size, threads," << std::endl
+       << "  size, seconds, MB/s; NA marks a parameter that does not apply." << std::endl;
+}
+
+// compressible pseudo-random text
+std::string make_text(std::size_t sz)
+{
+    static const char * words[] = { "ACGT", "zstr", "deflate", "block", " ", "\n", "gzip", "TTAGGG" };
+    std::mt19937 rg(42);
+    std::string s;
+    s.reserve(sz);
+    while (s.size() < sz)
+    {
+        s += words[rg() % 8];
+        if (rg() % 4 == 0) s += static_cast< char >('a' + rg() % 26);
+    }
+    s.resize(sz);
+    return s;
+}
+
+// FASTQ-like records: random bases, and qualities which drift slowly, as in real reads
+std::string make_fastq(std::size_t sz)
+{
+    static const std::size_t read_len = 150;
+    std::mt19937 rg(42);
+    std::string s;
+    s.reserve(sz + 2 * read_len + 64);
+    for (std::size_t i = 0; s.size() < sz; ++i)
+    {
+        s += "@read." + std::to_string(i) + " length=" + std::to_string(read_len) + "\n";
+        for (std::size_t j = 0; j < read_len; ++j) s += "ACGT"[rg() % 4];
+        s += "\n+\n";
+        int q = 40;
+        for (std::size_t j = 0; j < read_len; ++j)
+        {
+            q = std::max(2, std::min(41, q + static_cast< int >(rg() % 5) - 2 - (j % 16 == 0)));
+            s += static_cast< char >('!' + q);
+        }
+        s += "\n";
+    }
+    // end on a record boundary
+    s.resize(s.rfind('@'));
+    return s;
+}
+
+// Run f for the given number of rounds, and return the best time, in seconds.
+template < typename Function >
+double best_time(unsigned rounds, Function f)
+{
+    double best = 0;
+    for (unsigned i = 0; i < rounds; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration< double > d = std::chrono::steady_clock::now() - start;
+        if (i == 0 or d.count() < best) best = d.count();
+    }
+    return best;
+}
+
+// parameters of one measurement; NA is printed for those left negative
+struct row
+{
+    std::string op;
+    std::string data;
+    std::string input;
+    int level;
+    long buff_size;
+    int threads;
+
+    row(const std::string& _op, const std::string& _data, const std::string& _input = "NA",
+        int _level = -1, long _buff_size = -1, int _threads = -1)
+        : op(_op), data(_data), input(_input), level(_level), buff_size(_buff_size), threads(_threads) {}
+}; // struct row
+
+std::string na(long v)
+{
+    return v < 0? std::string("NA") : std::to_string(v);
+}
+
+void report(const row& r, std::size_t size, double t)
+{
+    std::cout << zstr::block_backend() << "\t" << r.op << "\t" << r.data << "\t" << r.input << "\t"
+              << na(r.level) << "\t" << na(r.buff_size) << "\t" << na(r.threads) << "\t"
+              << size << "\t" << t << "\t" << size / t / (1 << 20) << std::endl;
+}
+
+// stream buffer which discards its output
+class null_streambuf
+    : public std::streambuf
+{
+protected:
+    std::streamsize xsputn(const char *, std::streamsize n) override { return n; }
+    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+}; // class null_streambuf
+
+void write_file(const std::string& fn, const std::string& s)
+{
+    std::ofstream ofs(fn, std::ios_base::binary);
+    ofs.write(s.data(), s.size());
+    if (not ofs) throw std::runtime_error("error writing: " + fn);
+}
+
+// Time a shell command; return false if it fails.
+bool time_command(unsigned rounds, const std::string& cmd, double& t)
+{
+    bool ok = true;
+    t = best_time(rounds, [&] () { ok = ok and std::system(cmd.c_str()) == 0; });
+    return ok;
+}
+
+void benchmark_write(const std::string& data, const std::string& s, unsigned threads, unsigned rounds)
+{
+    auto write = [&] (int level, std::size_t buff_size, unsigned t) {
+        report(row("write", data, "NA", level, buff_size, t), s.size(), best_time(rounds, [&] () {
+                    null_streambuf sink;
+                    zstr::ostreambuf zsbuf(&sink, buff_size, level, t);
+                    std::ostream os(&zsbuf);
+                    os.write(s.data(), s.size());
+                }));
+    };
+    for (int level : { 1, 6, 9 })
+    {
+        write(level, zstr::ostreambuf::default_buff_size, 0);
+    }
+    for (std::size_t buff_size : { 1 << 12, 1 << 16 })
+    {
+        write(6, buff_size, 0);
+    }
+    write(6, zstr::ostreambuf::default_buff_size, threads);
+    for (unsigned t : { 0u, threads })
+    {
+        report(row("bgzf_write", data, "NA", 6, -1, t), s.size(), best_time(rounds, [&] () {
+                    null_streambuf sink;
+                    zstr::ostreambuf zsbuf(&sink, zstr::ostreambuf::default_buff_size, 6, t, zstr::format::bgzf);
+                    std::ostream os(&zsbuf);
+                    os.write(s.data(), s.size());
+                }));
+    }
+}
+
+void benchmark_read(const std::string& data, const std::string& input, const std::string& fn,
+                    std::size_t size, unsigned rounds)
+{
+    for (std::size_t buff_size : { 1 << 12, 1 << 16, 1 << 20 })
+    {
+        report(row("read_block", data, input, -1, buff_size, 0), size, best_time(rounds, [&] () {
+                    std::ifstream ifs(fn, std::ios_base::binary);
+                    zstr::istreambuf zsbuf(ifs.rdbuf(), buff_size);
+                    std::size_t n = 0;
+                    for (auto blk = zsbuf.next_block(); blk.second > 0; blk = zsbuf.next_block()) n += blk.second;
+                    if (n != size) throw std::runtime_error("short read: " + fn);
+                }));
+    }
+    std::size_t buff_size = zstr::istreambuf::default_buff_size;
+    report(row("read_lines", data, input, -1, buff_size, 0), size, best_time(rounds, [&] () {
+                std::ifstream ifs(fn, std::ios_base::binary);
+                zstr::istreambuf zsbuf(ifs.rdbuf(), buff_size);
+                zstr::line_reader lr(zsbuf);
+                zstr::line_reader::line l;
+                while (lr.next(l)) {}
+            }));
+    report(row("read_getline", data, input, -1, buff_size, 0), size, best_time(rounds, [&] () {
+                std::ifstream ifs(fn, std::ios_base::binary);
+                zstr::istreambuf zsbuf(ifs.rdbuf(), buff_size);
+                std::istream is(&zsbuf);
+                std::string line;
+                while (std::getline(is, line)) {}
+            }));
+}
+
+void benchmark_bgzf_read(const std::string& data, const std::string& z, std::size_t size,
+                         unsigned threads, unsigned rounds)
+{
+    std::string buff(1 << 16, '\0');
+    report(row("bgzf_read", data, "bgzf", -1, -1, 0), size, best_time(rounds, [&] () {
+                std::istringstream iss(z);
+                zstr::bgzf_istreambuf zsbuf(iss.rdbuf());
+                while (zsbuf.sgetn(&buff[0], buff.size()) > 0) {}
+            }));
+    report(row("bgzf_read", data, "bgzf", -1, zstr::istreambuf::default_buff_size, threads), size, best_time(rounds, [&] () {
+                std::istringstream iss(z);
+                zstr::istreambuf zsbuf(iss.rdbuf(), zstr::istreambuf::default_buff_size, true, threads);
+                while (zsbuf.sgetn(&buff[0], buff.size()) > 0) {}
+            }));
+}
+
+int main(int argc, char * argv[])
+{
+    std::size_t size_mb = 16;
+    unsigned threads = 4;
+    unsigned rounds = 3;
+    std::string tmp_dir = "/tmp";
+    bool baselines = true;
+    int c;
+    while ((c = getopt(argc, argv, "s:t:r:d:nh?")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            size_mb = std::stoul(optarg);
+            break;
+        case 't':
+            threads = std::stoul(optarg);
+            break;
+        case 'r':
+            rounds = std::stoul(optarg);
+            break;
+        case 'd':
+            tmp_dir = optarg;
+            break;
+        case 'n':
+            baselines = false;
+            break;
+        case '?':
+        case 'h':
+            usage(std::cout, argv[0]);
+            std::exit(EXIT_SUCCESS);
+            break;
+        default:
+            usage(std::cerr, argv[0]);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    if (baselines and std::system("gzip --version >/dev/null 2>&1") != 0)
+    {
+        std::cerr << "gzip not found: skipping baselines" << std::endl;
+        baselines = false;
+    }
+    std::cout << "backend\top\tdata\tinput\tlevel\tbuff_size\tthreads\tsize\tseconds\tMBps" << std::endl;
+    for (std::string data : { "text", "fastq" })
+    {
+        std::string s = (data == "text"? make_text(size_mb << 20) : make_fastq(size_mb << 20));
+        std::string prefix = tmp_dir + "/benchmark-zstr." + std::to_string(getpid()) + "." + data;
+        std::string txt_fn = prefix + ".txt";
+        std::string gz_fn = prefix + ".gz";
+        write_file(txt_fn, s);
+        {
+            std::ofstream ofs(gz_fn, std::ios_base::binary);
+            zstr::ostream os(ofs.rdbuf());
+            os.write(s.data(), s.size());
+        }
+        std::string z;
+        {
+            std::ostringstream oss;
+            {
+                zstr::ostream os(oss.rdbuf(), 0, zstr::format::bgzf);
+                os.write(s.data(), s.size());
+            }
+            z = oss.str();
+        }
+        std::size_t size = s.size();
+
+        benchmark_write(data, s, threads, rounds);
+        benchmark_read(data, "text", txt_fn, size, rounds);
+        benchmark_read(data, "gzip", gz_fn, size, rounds);
+        benchmark_bgzf_read(data, z, size, threads, rounds);
+        if (baselines)
+        {
+            double t;
+            for (int level : { 1, 6, 9 })
+            {
+                if (time_command(rounds, "gzip -c -" + std::to_string(level) + " <" + txt_fn + " >/dev/null", t))
+                    report(row("gzip", data, "NA", level), size, t);
+            }
+            if (time_command(rounds, "zcat <" + gz_fn + " >/dev/null", t))
+                report(row("zcat", data, "gzip"), size, t);
+        }
+        std::remove(txt_fn.c_str());
+        std::remove(gz_fn.c_str());
+    }
+}
@@ -0,0 +1,1373 @@
+#define CATCH_CONFIG_MAIN
+#include "catch.hpp"
+
+#include <chrono>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "pfor.hpp"
+#include "zstr.hpp"
+
+// compressible pseudo-random text
+std::string make_text(std::size_t sz, unsigned seed = 42)
+{
+    static const char * words[] = { "ACGT", "zstr", "deflate", "block", " ", "\n", "gzip", "TTAGGG" };
+    std::mt19937 rg(seed);
+    std::string s;
+    while (s.size() < sz)
+    {
+        s += words[rg() % 8];
+    }
+    s.resize(sz);
+    return s;
+}
+
+std::string compress(const std::string& s, std::size_t buff_size, unsigned threads,
+                     std::size_t sync_every = 0, zstr::format fmt = zstr::format::gzip)
+{
+    std::ostringstream oss;
+    {
+        zstr::ostreambuf zsbuf(oss.rdbuf(), buff_size, Z_DEFAULT_COMPRESSION, threads, fmt);
+        std::ostream os(&zsbuf);
+        os.exceptions(std::ios_base::badbit);
+        for (std::size_t i = 0; i < s.size(); )
+        {
+            std::size_t len = sync_every > 0? std::min(sync_every, s.size() - i) : s.size();
+            os.write(&s[i], len);
+            if (sync_every > 0) os.flush();
+            i += len;
+        }
+    }
+    return oss.str();
+}
+
+std::string decompress(const std::string& s, std::size_t buff_size = 1 << 16, unsigned threads = 0)
+{
+    std::istringstream iss(s);
+    zstr::istreambuf zsbuf(iss.rdbuf(), buff_size, true, threads);
+    std::istream is(&zsbuf);
+    is.exceptions(std::ios_base::badbit);
+    std::string res;
+    char buff[1 << 12];
+    while (is.read(buff, sizeof(buff)) or is.gcount() > 0)
+    {
+        res.append(buff, is.gcount());
+    }
+    return res;
+}
+
+TEST_CASE("parallel compression round trip", "[ostreambuf][parallel]")
+{
+    for (std::size_t sz : { 0, 1, 100000, 1000000 })
+    {
+        std::string s = make_text(sz);
+        for (unsigned threads : { 1, 4 })
+        {
+            SECTION("size " + std::to_string(sz) + " threads " + std::to_string(threads))
+            {
+                std::string z = compress(s, 1 << 16, threads);
+                CHECK( z.substr(0, 2) == "\x1F\x8B" );
+                // output does not depend on thread scheduling
+                CHECK( z == compress(s, 1 << 16, threads) );
+                CHECK( decompress(z) == s );
+                CHECK( decompress(compress(s, 1 << 16, threads, 70000)) == s );
+            }
+        }
+    }
+}
+
+TEST_CASE("parallel compression ratio", "[ostreambuf][parallel]")
+{
+    // with the 32KB dictionary carried over, blocks compress about as well as a single stream
+    std::string s = make_text(1 << 20);
+    std::size_t seq_sz = compress(s, 1 << 16, 0).size();
+    std::size_t par_sz = compress(s, 1 << 16, 4).size();
+    CHECK( par_sz < seq_sz + seq_sz / 50 );
+}
+
+// split BGZF data into blocks, checking the block headers
+std::vector< std::string > bgzf_blocks(const std::string& z)
+{
+    std::vector< std::string > res;
+    std::size_t pos = 0;
+    while (pos < z.size())
+    {
+        REQUIRE( z.size() >= pos + 18 );
+        REQUIRE( z.substr(pos, 4) == std::string("\x1F\x8B\x08\x04", 4) );
+        REQUIRE( z.substr(pos + 10, 6) == std::string("\x06\x00" "BC" "\x02\x00", 6) );
+        std::size_t bsize = (unsigned char)z[pos + 16] + ((unsigned char)z[pos + 17] << 8) + 1;
+        REQUIRE( z.size() >= pos + bsize );
+        res.push_back(z.substr(pos, bsize));
+        pos += bsize;
+    }
+    return res;
+}
+
+TEST_CASE("bgzf output", "[ostreambuf][bgzf]")
+{
+    static const std::string eof_block(
+        "\x1F\x8B\x08\x04\x00\x00\x00\x00\x00\xFF\x06\x00\x42\x43\x02\x00"
+        "\x1B\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00", 28);
+    for (std::size_t sz : { 0, 1, 0xFF00, 1000000 })
+    {
+        std::string s = make_text(sz);
+        std::string z = compress(s, 1 << 16, 0, 0, zstr::format::bgzf);
+        auto blk_v = bgzf_blocks(z);
+        REQUIRE( not blk_v.empty() );
+        CHECK( blk_v.back() == eof_block );
+        CHECK( blk_v.size() == (sz + 0xFEFF) / 0xFF00 + 1 );
+        // every block is a self-contained gzip member
+        std::string s2;
+        for (const auto& b : blk_v)
+        {
+            CHECK( b.size() <= 0x10000 );
+            s2 += decompress(b);
+        }
+        CHECK( s2 == s );
+        CHECK( decompress(z) == s );
+        // blocks are independent, so parallel output is identical
+        CHECK( compress(s, 1 << 16, 4, 0, zstr::format::bgzf) == z );
+    }
+    SECTION("incompressible data")
+    {
+        std::mt19937 rg(17);
+        std::string s(300000, '\0');
+        for (auto& c : s) c = static_cast< char >(rg());
+        std::string z = compress(s, 1 << 16, 2, 0, zstr::format::bgzf);
+        CHECK( bgzf_blocks(z).size() == 6 );
+        CHECK( decompress(z) == s );
+    }
+    SECTION("sync ends a block")
+    {
+        std::string s = make_text(100000);
+        std::string z = compress(s, 1 << 16, 0, 30000, zstr::format::bgzf);
+        CHECK( bgzf_blocks(z).size() == 5 );
+        CHECK( decompress(z) == s );
+    }
+}
+
+TEST_CASE("bgzf random access", "[bgzf_istreambuf]")
+{
+    std::string s = make_text(500000);
+    std::string z = compress(s, 1 << 16, 0, 0, zstr::format::bgzf);
+    std::istringstream iss(z);
+    zstr::bgzf_istreambuf zsbuf(iss.rdbuf());
+    std::istream is(&zsbuf);
+    is.exceptions(std::ios_base::badbit);
+    // record the virtual offset of every line
+    std::vector< std::pair< std::streampos, std::string > > line_v;
+    std::string line;
+    while (true)
+    {
+        std::streampos pos = is.tellg();
+        if (not getline(is, line)) break;
+        line_v.emplace_back(pos, line);
+    }
+    CHECK( line_v.size() == static_cast< std::size_t >(std::count(s.begin(), s.end(), '\n') + 1) );
+    std::mt19937 rg(1);
+    for (int i = 0; i < 200; ++i)
+    {
+        const auto& p = line_v[rg() % line_v.size()];
+        is.clear();
+        is.seekg(p.first);
+        REQUIRE( getline(is, line) );
+        CHECK( line == p.second );
+    }
+    SECTION("uncompressed offsets")
+    {
+        // one entry per block, including the EOF marker
+        CHECK( zsbuf.index().entries().size() == bgzf_blocks(z).size() );
+        for (int i = 0; i < 200; ++i)
+        {
+            std::size_t u = rg() % s.size();
+            is.clear();
+            REQUIRE( zsbuf.useek(u) );
+            CHECK( zsbuf.utell() == u );
+            char buff[100];
+            is.read(buff, 100);
+            CHECK( std::string(buff, is.gcount()) == s.substr(u, 100) );
+        }
+    }
+    SECTION("index save and load")
+    {
+        std::ostringstream oss;
+        zsbuf.index().save(oss);
+        CHECK( oss.str().size() == 8 + 16 * (zsbuf.index().entries().size() - 1) );
+        std::istringstream idx_iss(oss.str());
+        zstr::bgzf_index idx;
+        idx.load(idx_iss);
+        REQUIRE( idx.entries().size() == zsbuf.index().entries().size() );
+        for (std::size_t u = 0; u < s.size(); u += 9999)
+        {
+            CHECK( idx.virtual_offset(u) == zsbuf.index().virtual_offset(u) );
+        }
+    }
+}
+
+TEST_CASE("bgzf_ifstream", "[bgzf_istreambuf]")
+{
+    std::string s = make_text(300000);
+    const std::string fn = "test-zstr.tmp.gz";
+    {
+        zstr::ofstream ofs(fn, std::ios_base::out, 2, zstr::format::bgzf);
+        ofs << s;
+    }
+    {
+        zstr::bgzf_ifstream ifs(fn);
+        ifs.useek(123456);
+        CHECK( ifs.utell() == 123456 );
+        std::string t(1000, '\0');
+        ifs.read(&t[0], t.size());
+        CHECK( t == s.substr(123456, 1000) );
+        std::ofstream idx_ofs(fn + ".gzi", std::ios_base::out | std::ios_base::binary);
+        ifs.index().save(idx_ofs);
+    }
+    {
+        // index loaded from the .gzi file
+        zstr::bgzf_ifstream ifs(fn);
+        CHECK( ifs.index().entries().size() == 6 );
+        ifs.useek(s.size() - 10);
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        CHECK( oss.str() == s.substr(s.size() - 10) );
+    }
+    std::remove(fn.c_str());
+    std::remove((fn + ".gzi").c_str());
+}
+
+TEST_CASE("parallel decompression", "[istreambuf][parallel]")
+{
+    std::string s = make_text(1000000);
+    SECTION("multi-member gzip")
+    {
+        std::string z = compress(s, 1 << 16, 0, 5000);
+        for (std::size_t buff_size : { 1 << 10, 1 << 14, 1 << 20 })
+        {
+            CHECK( decompress(z, buff_size, 3) == s );
+        }
+    }
+    SECTION("bgzf")
+    {
+        std::string z = compress(s, 1 << 16, 0, 0, zstr::format::bgzf);
+        CHECK( decompress(z, 1 << 17, 4) == s );
+        CHECK( decompress(z, 1 << 10, 4) == s );
+    }
+    SECTION("single member")
+    {
+        std::string z = compress(s, 1 << 16, 0);
+        CHECK( decompress(z, 1 << 12, 2) == s );
+    }
+    SECTION("concatenated streams")
+    {
+        std::string z = compress(s, 1 << 16, 0) + compress(s, 1 << 16, 2, 300000);
+        CHECK( decompress(z, 1 << 12, 2) == s + s );
+    }
+    SECTION("gzip magic inside compressed data")
+    {
+        // random bytes are stored verbatim, magic bytes included
+        std::mt19937 rg(3);
+        std::string t(400000, '\0');
+        for (auto& c : t) c = static_cast< char >(rg());
+        for (std::size_t i = 0; i + 4 < t.size(); i += 997) t.replace(i, 4, "\x1F\x8B\x08\x00", 4);
+        std::string z = compress(t, 1 << 16, 0, 50000);
+        CHECK( decompress(z, 1 << 12, 4) == t );
+    }
+    SECTION("text input")
+    {
+        CHECK( decompress(s, 1 << 12, 2) == s );
+        // too short to check for the gzip magic
+        CHECK( decompress("x", 1 << 12, 2) == "x" );
+    }
+    SECTION("corrupt input")
+    {
+        std::string z = compress(s, 1 << 16, 0, 5000);
+        z[z.size() / 2] ^= 0x55;
+        CHECK_THROWS( decompress(z, 1 << 12, 2) );
+    }
+}
+
+// source streambuf which throws after a given number of bytes
+class throwing_streambuf
+    : public std::stringbuf
+{
+public:
+    throwing_streambuf(const std::string& s, std::size_t _limit) : std::stringbuf(s), limit(_limit) {}
+    virtual std::streamsize xsgetn(char * s, std::streamsize n)
+    {
+        if (static_cast< std::size_t >(n) > limit) throw std::runtime_error("source error");
+        limit -= n;
+        return std::stringbuf::xsgetn(s, n);
+    }
+private:
+    std::size_t limit;
+};
+
+TEST_CASE("read-ahead", "[istreambuf][readahead]")
+{
+    std::string s = make_text(500000);
+    std::string z = compress(s, 1 << 16, 0, 70000);
+    for (unsigned depth : { 1, 2, 5 })
+    {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 12, true, 0, depth);
+        std::istream is(&zsbuf);
+        std::ostringstream oss;
+        oss << is.rdbuf();
+        CHECK( oss.str() == s );
+    }
+    SECTION("with parallel decompression")
+    {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 12, true, 2, 3);
+        std::istream is(&zsbuf);
+        std::ostringstream oss;
+        oss << is.rdbuf();
+        CHECK( oss.str() == s );
+    }
+    SECTION("source errors are rethrown")
+    {
+        throwing_streambuf sbuf(z, 50000);
+        zstr::istreambuf zsbuf(&sbuf, 1 << 12, true, 0, 2);
+        std::istream is(&zsbuf);
+        is.exceptions(std::ios_base::badbit);
+        std::string line;
+        CHECK_THROWS( while (getline(is, line)) {} );
+    }
+    SECTION("early destruction")
+    {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 10, true, 0, 4);
+        CHECK( zsbuf.sgetc() == s[0] );
+    }
+}
+
+TEST_CASE("mmap input", "[istreambuf][mmap]")
+{
+    std::string s = make_text(300000);
+    const std::string fn = "test-zstr.tmp";
+    for (bool gz : { false, true })
+    {
+        {
+            std::ofstream ofs(fn, std::ios_base::out | std::ios_base::binary);
+            ofs << (gz? compress(s, 1 << 16, 0, 100000) : s);
+        }
+        zstr::ifstream ifs(fn, std::ios_base::in, 0, true);
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        CHECK( oss.str() == s );
+        zstr::ifstream ifs_mem(fn, zstr::memory_profile::low(), std::ios_base::in, 0, true);
+        std::ostringstream oss_mem;
+        oss_mem << ifs_mem.rdbuf();
+        CHECK( oss_mem.str() == s );
+    }
+    // files which cannot be mapped are opened as streams, with their errors
+    CHECK_THROWS_AS( zstr::ifstream("/nonexistent", std::ios_base::in, 0, true), const strict_fstream::Exception & );
+    {
+        std::ofstream ofs(fn, std::ios_base::out | std::ios_base::binary);
+        ofs << s;
+    }
+    SECTION("text is served from the mapping")
+    {
+        zstr::mmap_streambuf mm(fn);
+        zstr::istreambuf zsbuf(&mm, 1 << 12);
+        CHECK( zsbuf.in_avail() == 0 );
+        CHECK( zsbuf.sgetc() == s[0] );
+        // the whole file is available without a copy
+        CHECK( zsbuf.in_avail() == static_cast< std::streamsize >(s.size()) );
+    }
+    SECTION("seeking")
+    {
+        zstr::mmap_streambuf mm(fn);
+        std::istream is(&mm);
+        is.seekg(1000);
+        CHECK( is.tellg() == 1000 );
+        CHECK( is.get() == s[1000] );
+        is.seekg(-1, std::ios_base::end);
+        CHECK( is.get() == s.back() );
+    }
+    CHECK_THROWS_AS( zstr::mmap_streambuf("/nonexistent"), const zstr::Exception & );
+    std::remove(fn.c_str());
+}
+
+TEST_CASE("io_uring file streambuf", "[istreambuf][ostreambuf][uring]")
+{
+    std::string s = make_text(1000000);
+    const std::string fn = "test-zstr.tmp.gz";
+    for (std::size_t buff_size : { 1000, 1 << 16 })
+    {
+        for (unsigned depth : { 1, 4 })
+        {
+            {
+                zstr::uring_streambuf usbuf(fn, std::ios_base::out, buff_size, depth);
+#ifdef ZSTR_WITH_IO_URING
+                CHECK( usbuf.uses_io_uring() );
+#else
+                CHECK( not usbuf.uses_io_uring() );
+#endif
+                zstr::ostreambuf zsbuf(&usbuf, 1 << 14, Z_DEFAULT_COMPRESSION);
+                std::ostream os(&zsbuf);
+                os.write(s.data(), s.size());
+                os.flush();
+                CHECK( usbuf.pubsync() == 0 );
+                os.write(s.data(), s.size());
+            }
+            {
+                zstr::uring_streambuf usbuf(fn, std::ios_base::in, buff_size, depth);
+                zstr::istreambuf zsbuf(&usbuf, 1 << 14);
+                std::istream is(&zsbuf);
+                std::ostringstream oss;
+                oss << is.rdbuf();
+                CHECK( oss.str() == s + s );
+            }
+        }
+    }
+    SECTION("append")
+    {
+        {
+            zstr::uring_streambuf usbuf(fn, std::ios_base::out | std::ios_base::app);
+            zstr::ostreambuf zsbuf(&usbuf);
+            zsbuf.sputn(s.data(), 1000);
+        }
+        zstr::uring_streambuf usbuf(fn);
+        zstr::istreambuf zsbuf(&usbuf);
+        std::istream is(&zsbuf);
+        std::ostringstream oss;
+        oss << is.rdbuf();
+        CHECK( oss.str() == s + s + s.substr(0, 1000) );
+    }
+    SECTION("empty file")
+    {
+        {
+            std::ofstream ofs(fn);
+        }
+        zstr::uring_streambuf usbuf(fn);
+        CHECK( usbuf.sgetc() == std::char_traits< char >::eof() );
+    }
+    SECTION("destruction with requests in flight")
+    {
+        {
+            // writes of the full buffers are still queued, and the rest is flushed
+            zstr::uring_streambuf usbuf(fn, std::ios_base::out, 1000, 4);
+            usbuf.sputn(s.data(), 3500);
+        }
+        {
+            // the reads queued ahead are still pending
+            zstr::uring_streambuf usbuf(fn, std::ios_base::in, 1000, 4);
+            CHECK( usbuf.sgetc() == s[0] );
+        }
+        std::ifstream ifs(fn, std::ios_base::binary);
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        CHECK( oss.str() == s.substr(0, 3500) );
+    }
+    std::remove(fn.c_str());
+    CHECK_THROWS_AS( zstr::uring_streambuf("/nonexistent"), const zstr::Exception & );
+}
+
+TEST_CASE("buffer pool","[istreambuf][ostreambuf][buffer_pool]")
+{
+    std::string s = make_text(200000);
+    zstr::buffer_pool & pool = zstr::buffer_pool::shared();
+    CHECK( pool.max_buffers() == 0 );
+    pool.set_max_buffers(4);
+    std::string z = compress(s, 1 << 14, 0, 1000);
+    // one buffer of each kind is kept
+    CHECK( pool.size() == 2 );
+    const char * p;
+    {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14);
+        CHECK( pool.size() == 0 );
+        p = zsbuf.next_block().first;
+    }
+    CHECK( pool.size() == 2 );
+    // streams in a tight loop reuse the same buffers
+    for (int i = 0; i < 10; ++i)
+    {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14);
+        auto blk = zsbuf.next_block();
+        CHECK( (blk.first == p or pool.size() == 0) );
+        CHECK( std::string(blk.first, blk.second) == s.substr(0, blk.second) );
+    }
+    // many members through one inflate state
+    CHECK( decompress(z, 1 << 14) == s );
+    // other sizes are allocated separately
+    CHECK( decompress(z, 1 << 12) == s );
+    CHECK( pool.size() == 4 );
+    pool.set_max_buffers(0);
+    CHECK( pool.size() == 0 );
+}
+
+TEST_CASE("memory profile", "[istreambuf][ostreambuf][memory_profile]")
+{
+    std::string s = make_text(300000);
+    zstr::slab_allocator alloc;
+    SECTION("many lazy output streams")
+    {
+        const unsigned n = 50;
+        std::vector< std::ostringstream > oss_v(n);
+        std::vector< std::unique_ptr< zstr::ostreambuf > > zsbuf_v;
+        for (auto& oss : oss_v)
+        {
+            zsbuf_v.emplace_back(new zstr::ostreambuf(oss.rdbuf(), zstr::memory_profile::low(&alloc)));
+        }
+        // nothing is allocated before the first write
+        CHECK( alloc.in_use() == 0 );
+        for (std::size_t i = 0; i < s.size(); i += 1000)
+        {
+            zsbuf_v[i / 1000 % n]->sputn(&s[i], std::min< std::size_t >(1000, s.size() - i));
+        }
+        std::size_t per_stream = alloc.in_use() / n;
+        CHECK( per_stream > 0 );
+        CHECK( per_stream < 40000 );
+        zsbuf_v.clear();
+        CHECK( alloc.in_use() == 0 );
+        // every stream is valid gzip, written with a smaller window
+        std::string t;
+        for (std::size_t i = 0; i < s.size(); i += 1000)
+        {
+            t += s.substr(i, 1000);
+        }
+        std::vector< std::string > out_v(n);
+        for (unsigned j = 0; j < n; ++j)
+        {
+            out_v[j] = decompress(oss_v[j].str());
+        }
+        std::string u;
+        for (std::size_t i = 0; i < s.size(); i += 1000)
+        {
+            std::string& o = out_v[i / 1000 % n];
+            u += o.substr(0, 1000);
+            o.erase(0, 1000);
+        }
+        CHECK( u == s );
+        // memory is reused by the next streams
+        std::size_t reserved = alloc.reserved();
+        std::ostringstream oss;
+        {
+            zstr::ostreambuf zsbuf(oss.rdbuf(), zstr::memory_profile::low(&alloc));
+            zsbuf.sputn(s.data(), s.size());
+        }
+        CHECK( alloc.reserved() == reserved );
+        CHECK( decompress(oss.str()) == s );
+    }
+    SECTION("memory limit")
+    {
+        zstr::slab_allocator small(20000);
+        std::ostringstream oss;
+        CHECK_THROWS_AS( zstr::ostreambuf(oss.rdbuf(), zstr::memory_profile(1 << 14, 15, 8, false, &small)),
+                         const zstr::Exception & );
+        CHECK( small.reserved() <= 20000 );
+    }
+    SECTION("input")
+    {
+        std::string z = compress(s, 1 << 16, 0, 100000);
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), zstr::memory_profile::low(&alloc));
+        CHECK( zsbuf.in_avail() == 0 );
+        CHECK( alloc.in_use() == 0 );
+        std::istream is(&zsbuf);
+        std::ostringstream oss;
+        oss << is.rdbuf();
+        CHECK( oss.str() == s );
+        CHECK( alloc.in_use() > 0 );
+    }
+}
+
+TEST_CASE("block access", "[istreambuf][next_block]")
+{
+    std::string s = make_text(300000);
+    for (const std::string& z : { s, compress(s, 1 << 16, 0, 100000) })
+    {
+        for (unsigned threads : { 0, 2 })
+        {
+            std::istringstream iss(z);
+            zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14, true, threads);
+            // mix with the character interface
+            std::string t(1, static_cast< char >(zsbuf.sbumpc()));
+            while (true)
+            {
+                auto blk = zsbuf.next_block();
+                if (blk.second == 0) break;
+                CHECK( blk.second <= (threads > 0? s.size() : 1 << 14) );
+                t.append(blk.first, blk.second);
+            }
+            CHECK( t == s );
+            CHECK( zsbuf.next_block().second == 0 );
+            CHECK( zsbuf.sgetc() == std::char_traits< char >::eof() );
+        }
+    }
+    SECTION("uncompressed input is passed through in place")
+    {
+        std::istringstream iss(s);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14, true, 0, 2);
+        std::string t;
+        std::set< const char * > starts;
+        while (true)
+        {
+            auto blk = zsbuf.next_block();
+            if (blk.second == 0) break;
+            starts.insert(blk.first);
+            t.append(blk.first, blk.second);
+        }
+        CHECK( t == s );
+        // blocks come from the read-ahead slots, not from a single copy buffer
+        CHECK( starts.size() > 1 );
+    }
+    SECTION("format detection")
+    {
+        std::string gz = compress(s, 1 << 16, 0, 0);
+        CHECK( zstr::istreambuf::is_compressed(gz.data(), gz.size()) );
+        CHECK( zstr::istreambuf::is_compressed(gz.data(), 2) );
+        CHECK( not zstr::istreambuf::is_compressed(gz.data(), 1) );
+        CHECK( not zstr::istreambuf::is_compressed(s.data(), s.size()) );
+        CHECK( zstr::istreambuf::is_compressed("\x78\x9c", 2) );
+    }
+}
+
+TEST_CASE("gzip checkpoint index", "[istreambuf][gzip_index]")
+{
+    std::string s = make_text(2000000);
+    for (std::size_t sync_every : { 0, 700000 })
+    {
+        std::string z = compress(s, 1 << 16, 0, sync_every);
+        // record the index while reading
+        zstr::gzip_index idx;
+        {
+            std::istringstream iss(z);
+            zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14, true, 2);
+            zsbuf.record_index(&idx, 1 << 16);
+            std::istream is(&zsbuf);
+            std::ostringstream oss;
+            oss << is.rdbuf();
+            CHECK( oss.str() == s );
+        }
+        REQUIRE( idx.checkpoints().size() > 5 );
+        CHECK( idx.checkpoints()[0].uoffset == 0 );
+        bool has_bits = false;
+        std::size_t window_size = zstr::gzip_index::window_size;
+        for (const auto & cp : idx.checkpoints())
+        {
+            CHECK( cp.window.size() <= window_size );
+            has_bits = has_bits or cp.bits != 0;
+        }
+        CHECK( has_bits );
+        SECTION("save and load")
+        {
+            std::stringstream ss;
+            idx.save(ss);
+            CHECK( ss.str().size() < z.size() );
+            zstr::gzip_index idx2;
+            idx2.load(ss);
+            REQUIRE( idx2.checkpoints().size() == idx.checkpoints().size() );
+            for (std::size_t i = 0; i < idx.checkpoints().size(); ++i)
+            {
+                CHECK( idx2.checkpoints()[i].uoffset == idx.checkpoints()[i].uoffset );
+                CHECK( idx2.checkpoints()[i].coffset == idx.checkpoints()[i].coffset );
+                CHECK( idx2.checkpoints()[i].bits == idx.checkpoints()[i].bits );
+                CHECK( idx2.checkpoints()[i].window == idx.checkpoints()[i].window );
+            }
+            std::istringstream bad("ZSTRGZI0");
+            CHECK_THROWS_AS( idx2.load(bad), const zstr::Exception & );
+        }
+        SECTION("parallel decompression")
+        {
+            for (std::size_t buff_size : { 1 << 10, 1 << 16 })
+            {
+                for (unsigned threads : { 1, 3 })
+                {
+                    std::istringstream iss(z);
+                    zstr::istreambuf zsbuf(iss.rdbuf(), buff_size, true, threads);
+                    zsbuf.set_index(idx);
+                    std::istream is(&zsbuf);
+                    std::ostringstream oss;
+                    oss << is.rdbuf();
+                    CHECK( oss.str() == s );
+                }
+            }
+            // an index of different data is detected
+            std::string z2 = compress(make_text(s.size(), 7), 1 << 16, 0, sync_every);
+            std::istringstream iss(z2);
+            zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14, true, 2);
+            zsbuf.set_index(idx);
+            std::istream is(&zsbuf);
+            is.exceptions(std::ios_base::badbit);
+            std::string line;
+            CHECK_THROWS( while (getline(is, line)) {} );
+        }
+        SECTION("seeking")
+        {
+            std::istringstream iss(z);
+            zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14);
+            std::istream is(&zsbuf);
+            // no index
+            is.seekg(1000);
+            CHECK( is.fail() );
+            is.clear();
+            zsbuf.set_index(idx);
+            std::mt19937 rg(17);
+            for (int i = 0; i < 20; ++i)
+            {
+                std::size_t pos = rg() % s.size();
+                is.seekg(pos);
+                REQUIRE( is.tellg() == static_cast< std::streamoff >(pos) );
+                char buff[100];
+                std::size_t len = std::min< std::size_t >(100, s.size() - pos);
+                is.read(buff, len);
+                CHECK( std::string(buff, len) == s.substr(pos, len) );
+                CHECK( is.tellg() == static_cast< std::streamoff >(pos + len) );
+            }
+            // read through member boundaries after a seek
+            is.seekg(5);
+            std::ostringstream oss;
+            oss << is.rdbuf();
+            CHECK( oss.str() == s.substr(5) );
+        }
+        SECTION("ifstream")
+        {
+            const std::string fn = "test-zstr.tmp.gz";
+            {
+                std::ofstream ofs(fn, std::ios_base::out | std::ios_base::binary);
+                ofs << z;
+            }
+            for (bool use_mmap : { false, true })
+            {
+                zstr::ifstream ifs(fn, std::ios_base::in, 0, use_mmap);
+                ifs.set_index(idx);
+                std::size_t pos = idx.checkpoints().back().uoffset + 10;
+                ifs.seekg(pos);
+                std::string t(100, '\0');
+                ifs.read(&t[0], t.size());
+                CHECK( t == s.substr(pos, 100) );
+            }
+            std::remove(fn.c_str());
+        }
+    }
+    SECTION("uncompressed input")
+    {
+        std::istringstream iss(s);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 14);
+        std::istream is(&zsbuf);
+        is.seekg(123456);
+        CHECK( is.get() == s[123456] );
+        is.seekg(-6, std::ios_base::cur);
+        CHECK( is.tellg() == 123451 );
+        CHECK( is.get() == s[123451] );
+    }
+}
+
+TEST_CASE("zstd codec", "[istreambuf][ostreambuf][zstd]")
+{
+    std::string s = make_text(1000000);
+#ifdef ZSTR_WITH_ZSTD
+    for (unsigned threads : { 0, 2 })
+    {
+        for (std::size_t sync_every : { 0, 300000 })
+        {
+            std::string z = compress(s, 1 << 16, threads, sync_every, zstr::format::zstd);
+            REQUIRE( z.size() >= 4 );
+            CHECK( z.substr(0, 4) == "\x28\xB5\x2F\xFD" );
+            CHECK( z.size() < s.size() / 4 );
+            CHECK( decompress(z) == s );
+            CHECK( decompress(z, 1 << 10) == s );
+        }
+    }
+    // an empty stream is a single empty frame
+    CHECK( decompress(compress("", 1 << 16, 0, 0, zstr::format::zstd)) == "" );
+    SECTION("corrupt input")
+    {
+        std::string z = compress(s, 1 << 16, 0, 0, zstr::format::zstd);
+        z[z.size() / 2] ^= 0x55;
+        z[z.size() / 2 + 1] ^= 0x55;
+        CHECK_THROWS_AS( decompress(z), const zstr::Exception & );
+    }
+#else
+    CHECK_THROWS_AS( compress(s, 1 << 16, 0, 0, zstr::format::zstd), const zstr::Exception & );
+    CHECK_THROWS_AS( decompress(std::string("\x28\xB5\x2F\xFD", 4) + s), const zstr::Exception & );
+#endif
+}
+
+TEST_CASE("lz4 codec", "[istreambuf][ostreambuf][lz4]")
+{
+    std::string s = make_text(1000000);
+#ifdef ZSTR_WITH_LZ4
+    for (int level : { Z_DEFAULT_COMPRESSION, 9 })
+    {
+        for (std::size_t sync_every : { 0, 300000 })
+        {
+            std::ostringstream oss;
+            {
+                zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 16, level, 0, zstr::format::lz4);
+                std::ostream os(&zsbuf);
+                for (std::size_t i = 0; i < s.size(); i += sync_every > 0? sync_every : s.size())
+                {
+                    os.write(&s[i], std::min(sync_every > 0? sync_every : s.size(), s.size() - i));
+                    os.flush();
+                }
+            }
+            std::string z = oss.str();
+            REQUIRE( z.size() >= 4 );
+            CHECK( z.substr(0, 4) == "\x04\x22\x4D\x18" );
+            CHECK( z.size() < s.size() / 2 );
+            CHECK( decompress(z) == s );
+            CHECK( decompress(z, 1 << 10) == s );
+        }
+    }
+    CHECK( decompress(compress("", 1 << 16, 0, 0, zstr::format::lz4)) == "" );
+    SECTION("corrupt input")
+    {
+        std::string z = compress(s, 1 << 16, 0, 0, zstr::format::lz4);
+        z[z.size() / 2] ^= 0x55;
+        CHECK_THROWS_AS( decompress(z), const zstr::Exception & );
+    }
+#else
+    CHECK_THROWS_AS( compress(s, 1 << 16, 0, 0, zstr::format::lz4), const zstr::Exception & );
+    CHECK_THROWS_AS( decompress(std::string("\x04\x22\x4D\x18", 4) + s), const zstr::Exception & );
+#endif
+}
+
+// sink streambuf which takes the given time for every write
+class slow_stringbuf
+    : public std::stringbuf
+{
+public:
+    slow_stringbuf(std::chrono::milliseconds _delay) : delay(_delay) {}
+    virtual std::streamsize xsputn(const char * s, std::streamsize n)
+    {
+        std::this_thread::sleep_for(delay);
+        return std::stringbuf::xsputn(s, n);
+    }
+private:
+    std::chrono::milliseconds delay;
+};
+
+TEST_CASE("adaptive compression level", "[ostreambuf][adaptive]")
+{
+    std::string s = make_text(1000000);
+    SECTION("target throughput")
+    {
+        for (double target_mbps : { 1e9, 1e-3 })
+        {
+            std::ostringstream oss;
+            {
+                zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 14, 6);
+                zsbuf.set_adaptive_level(2, 8, target_mbps);
+                std::ostream os(&zsbuf);
+                os.write(s.data(), s.size());
+                // an unreachable target ends at the lowest level, a trivial one at the highest
+                CHECK( zsbuf.current_level() == (target_mbps > 1? 2 : 8) );
+                os.write(s.data(), s.size());
+            }
+            CHECK( decompress(oss.str()) == s + s );
+        }
+    }
+    SECTION("sink speed")
+    {
+        // fast sink: deflate is the bottleneck
+        std::ostringstream oss;
+        {
+            zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 14);
+            zsbuf.set_adaptive_level(1, 9);
+            CHECK( zsbuf.current_level() == 6 );
+            std::ostream os(&zsbuf);
+            os.write(s.data(), s.size());
+            CHECK( zsbuf.current_level() == 1 );
+        }
+        CHECK( decompress(oss.str()) == s );
+        // slow sink: deflate can afford to work harder
+        slow_stringbuf ssbuf(std::chrono::milliseconds(20));
+        {
+            zstr::ostreambuf zsbuf(&ssbuf, 1 << 16, 1);
+            zsbuf.set_adaptive_level(1, 9);
+            std::ostream os(&zsbuf);
+            os.write(s.data(), s.size());
+            CHECK( zsbuf.current_level() > 5 );
+        }
+        CHECK( decompress(ssbuf.str()) == s );
+    }
+    std::ostringstream oss;
+    zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 16, 6, 2);
+    CHECK_THROWS_AS( zsbuf.set_adaptive_level(1, 9), const zstr::Exception & );
+}
+
+// sink streambuf which fails after a given number of bytes: by returning a
+// short count, or by throwing
+class failing_stringbuf
+    : public std::stringbuf
+{
+public:
+    failing_stringbuf(std::size_t _limit, bool _throws) : limit(_limit), throws(_throws) {}
+    virtual std::streamsize xsputn(const char * s, std::streamsize n)
+    {
+        if (static_cast< std::size_t >(n) > limit)
+        {
+            if (throws) throw std::runtime_error("sink error");
+            return 0;
+        }
+        limit -= n;
+        return std::stringbuf::xsputn(s, n);
+    }
+private:
+    std::size_t limit;
+    bool throws;
+};
+
+TEST_CASE("write-behind", "[ostreambuf][write_behind]")
+{
+    std::string s = make_text(1000000);
+    std::string z = compress(s, 1 << 14, 0, 300000);
+    for (unsigned depth : { 1, 2, 4 })
+    {
+        std::ostringstream oss;
+        {
+            zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 14);
+            zsbuf.set_write_behind(depth);
+            std::ostream os(&zsbuf);
+            for (std::size_t i = 0; i < s.size(); i += 300000)
+            {
+                os.write(&s[i], std::min< std::size_t >(300000, s.size() - i));
+                os.flush();
+                // sync() waits for the background thread
+                CHECK( decompress(oss.str()) == s.substr(0, i + 300000) );
+            }
+        }
+        // same output as the sequential mode
+        CHECK( oss.str() == z );
+    }
+    SECTION("adaptive level")
+    {
+        slow_stringbuf ssbuf(std::chrono::milliseconds(20));
+        {
+            zstr::ostreambuf zsbuf(&ssbuf, 1 << 16, 1);
+            zsbuf.set_adaptive_level(1, 9);
+            zsbuf.set_write_behind();
+            std::ostream os(&zsbuf);
+            for (std::size_t i = 0; i < s.size(); i += 100000)
+            {
+                os.write(&s[i], std::min< std::size_t >(100000, s.size() - i));
+                // safe to read while the background thread changes it
+                int l = zsbuf.current_level();
+                CHECK( (1 <= l and l <= 9) );
+            }
+            os.flush();
+            CHECK( zsbuf.current_level() > 5 );
+        }
+        CHECK( decompress(ssbuf.str()) == s );
+    }
+    SECTION("sink errors")
+    {
+        for (bool throws : { false, true })
+        {
+            failing_stringbuf fsbuf(20000, throws);
+            zstr::ostreambuf zsbuf(&fsbuf, 1 << 14);
+            zsbuf.set_write_behind();
+            std::ostream os(&zsbuf);
+            os.exceptions(std::ios_base::badbit);
+            CHECK_THROWS( os.write(s.data(), s.size()).flush() );
+        }
+    }
+    SECTION("ofstream")
+    {
+        const std::string fn = "test-zstr.tmp.gz";
+        {
+            zstr::ofstream ofs(fn);
+            ofs.set_write_behind(3);
+            ofs << s;
+        }
+        {
+            zstr::ifstream ifs(fn);
+            std::ostringstream oss;
+            oss << ifs.rdbuf();
+            CHECK( oss.str() == s );
+        }
+        std::remove(fn.c_str());
+    }
+    std::ostringstream oss;
+    zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 16, 6, 0, zstr::format::bgzf);
+    CHECK_THROWS_AS( zsbuf.set_write_behind(), const zstr::Exception & );
+}
+
+TEST_CASE("stream stats", "[istreambuf][ostreambuf][stats]")
+{
+    // counters are only kept with ZSTR_WITH_STATS
+    std::string s = make_text(300000);
+    std::ostringstream oss;
+    zstr::ostreambuf osbuf(oss.rdbuf(), 1 << 14);
+    {
+        std::ostream os(&osbuf);
+        os.write(s.data(), s.size());
+        os.flush();
+    }
+    std::string z = oss.str();
+    const zstr::stream_stats & ost = osbuf.stats();
+    std::string z2 = z + z;
+    std::istringstream iss(z2);
+    zstr::istreambuf isbuf(iss.rdbuf(), 1 << 12);
+    std::istream is(&isbuf);
+    std::ostringstream oss2;
+    oss2 << is.rdbuf();
+    CHECK( oss2.str() == s + s );
+    const zstr::stream_stats & ist = isbuf.stats();
+    if (zstr::detail::stats_enabled)
+    {
+        CHECK( ost.bytes_in == s.size() );
+        CHECK( ost.bytes_out == z.size() );
+        CHECK( ost.members == 1 );
+        CHECK( ost.calls >= s.size() / (1 << 14) );
+        CHECK( ost.codec_ns > 0 );
+        CHECK( ist.bytes_in == z2.size() );
+        CHECK( ist.bytes_out == 2 * s.size() );
+        CHECK( ist.members == 2 );
+        CHECK( ist.calls >= 2 * s.size() / (1 << 12) );
+        CHECK( ist.codec_ns > 0 );
+    }
+    else
+    {
+        CHECK( ost.bytes_in == 0 );
+        CHECK( ost.calls == 0 );
+        CHECK( ist.bytes_out == 0 );
+        CHECK( ist.codec_ns == 0 );
+    }
+    SECTION("worker threads and in-place sources")
+    {
+        std::string zb = compress(s, 1 << 14, 2, 0, zstr::format::bgzf);
+        std::ostringstream oss3;
+        {
+            zstr::ostreambuf zsbuf(oss3.rdbuf(), 1 << 14, Z_DEFAULT_COMPRESSION, 2, zstr::format::bgzf);
+            std::ostream os(&zsbuf);
+            os.write(s.data(), s.size());
+            os.flush();
+            if (zstr::detail::stats_enabled)
+            {
+                CHECK( zsbuf.stats().bytes_in == s.size() );
+                // all but the EOF marker
+                CHECK( zsbuf.stats().bytes_out == zb.size() - 28 );
+            }
+        }
+        for (unsigned readahead : { 0, 2 })
+        {
+            std::istringstream iss2(readahead > 0? s : zb);
+            zstr::istreambuf zsbuf(iss2.rdbuf(), 1 << 14, true, 2, readahead);
+            std::size_t n = 0;
+            for (auto blk = zsbuf.next_block(); blk.second > 0; blk = zsbuf.next_block()) n += blk.second;
+            CHECK( n == s.size() );
+            if (zstr::detail::stats_enabled)
+            {
+                CHECK( zsbuf.stats().bytes_in == iss2.str().size() );
+                CHECK( zsbuf.stats().bytes_out == s.size() );
+            }
+        }
+    }
+}
+
+TEST_CASE("preset dictionary", "[istreambuf][ostreambuf][dictionary]")
+{
+    // short records sharing most of their content
+    std::vector< std::string > rec_v;
+    std::string all;
+    for (unsigned i = 0; i < 2000; ++i)
+    {
+        rec_v.push_back("id=" + std::to_string(i * 7919 % 10007) + " status=OK path=/api/v1/items/"
+                        + std::to_string(i % 97) + " agent=zstr-test\n");
+        all += rec_v.back();
+    }
+    std::string dict;
+    for (unsigned i = 0; i < 50; ++i) dict += rec_v[i * 13];
+    auto write_records = [&] (zstr::format fmt, const std::string * dict_p, bool write_behind) {
+        std::ostringstream oss;
+        {
+            zstr::ostreambuf zsbuf(oss.rdbuf(), 1 << 12, Z_DEFAULT_COMPRESSION, 0, fmt);
+            if (dict_p) zsbuf.set_dictionary(*dict_p);
+            if (write_behind) zsbuf.set_write_behind();
+            std::ostream os(&zsbuf);
+            for (const auto& r : rec_v)
+            {
+                os << r;
+                os.flush();
+            }
+        }
+        return oss.str();
+    };
+    auto read_records = [&] (const std::string& z, const std::string * dict_p) {
+        std::istringstream iss(z);
+        zstr::istreambuf zsbuf(iss.rdbuf(), 1 << 12);
+        if (dict_p) zsbuf.set_dictionary(*dict_p);
+        std::istream is(&zsbuf);
+        std::string res;
+        std::string line;
+        while (std::getline(is, line)) res += line + "\n";
+        return res;
+    };
+    std::string z_gzip = write_records(zstr::format::gzip, nullptr, false);
+    std::string empty;
+    std::string z_raw = write_records(zstr::format::raw, &empty, false);
+    std::string z_dict = write_records(zstr::format::raw, &dict, false);
+    CHECK( read_records(z_gzip, nullptr) == all );
+    CHECK( read_records(z_raw, &empty) == all );
+    CHECK( read_records(z_dict, &dict) == all );
+    CHECK( z_raw.size() < z_gzip.size() );
+    CHECK( z_dict.size() < z_raw.size() / 2 );
+    SECTION("with write-behind")
+    {
+        CHECK( write_records(zstr::format::raw, &dict, true) == z_dict );
+    }
+    SECTION("raw deflate output only")
+    {
+        std::ostringstream oss;
+        zstr::ostreambuf zsbuf(oss.rdbuf());
+        CHECK_THROWS_AS( zsbuf.set_dictionary(dict), const zstr::Exception & );
+    }
+    SECTION("ifstream and ofstream")
+    {
+        std::string fn = "test-zstr.tmp.dict.z";
+        {
+            zstr::ofstream ofs(fn, std::ios_base::out, 0, zstr::format::raw);
+            ofs.set_dictionary(dict);
+            ofs << rec_v[0];
+            ofs.flush();
+            ofs << rec_v[1];
+        }
+        zstr::ifstream ifs(fn);
+        ifs.set_dictionary(dict);
+        std::ostringstream oss;
+        oss << ifs.rdbuf();
+        CHECK( oss.str() == rec_v[0] + rec_v[1] );
+        std::remove(fn.c_str());
+    }
+}
+
+TEST_CASE("record container", "[record_writer][record_reader]")
+{
+    std::vector< std::pair< std::string, std::string > > rec_v;
+    std::mt19937 rg(17);
+    for (unsigned i = 0; i < 3000; ++i)
+    {
+        std::string key = "key" + std::to_string(rg() % 100000);
+        // mostly small records, and a few larger than a block
+        std::string rec = make_text(i % 500 == 0? 20000 : rg() % 300);
+        rec_v.emplace_back(key, rec);
+    }
+    rec_v.emplace_back("", "empty key");
+    rec_v.emplace_back("empty record", "");
+    std::string fn = "test-zstr.tmp.records";
+    {
+        std::ofstream ofs(fn, std::ios_base::binary);
+        zstr::record_writer wr(ofs.rdbuf(), 1 << 12);
+        for (const auto& p : rec_v) wr.add(p.first, p.second);
+        wr.close();
+    }
+    // with duplicate keys, the first record wins
+    std::map< std::string, std::string > rec_m;
+    for (const auto& p : rec_v) rec_m.insert(p);
+    SECTION("lookups")
+    {
+        for (bool use_mmap : { false, true })
+        {
+            std::ifstream ifs(fn, std::ios_base::binary);
+            zstr::mmap_streambuf mm(fn);
+            zstr::record_reader rdr(use_mmap? static_cast< std::streambuf * >(&mm) : ifs.rdbuf());
+            CHECK( rdr.size() == rec_v.size() );
+            std::string rec;
+            for (const auto& p : rec_m)
+            {
+                CHECK( rdr.find(p.first, rec) );
+                CHECK( rec == p.second );
+            }
+            CHECK( not rdr.find("key", rec) );
+            CHECK( not rdr.find("zzz", rec) );
+        }
+    }
+    SECTION("the blocks are gzip members")
+    {
+        std::ifstream ifs(fn, std::ios_base::binary);
+        zstr::istreambuf zsbuf(ifs.rdbuf());
+        std::istream is(&zsbuf);
+        std::string all;
+        for (const auto& p : rec_v) all += p.second;
+        std::string s(all.size(), '\0');
+        is.read(&s[0], s.size());
+        CHECK( s == all );
+    }
+    SECTION("invalid input")
+    {
+        std::istringstream iss(std::string(100, 'x'));
+        CHECK_THROWS_AS( zstr::record_reader rdr(iss.rdbuf()), const zstr::Exception & );
+    }
+    SECTION("corrupt index")
+    {
+        std::string z;
+        {
+            std::ifstream ifs(fn, std::ios_base::binary);
+            std::ostringstream oss;
+            oss << ifs.rdbuf();
+            z = oss.str();
+        }
+        auto get = [&] (std::size_t pos, unsigned len) {
+            std::uint64_t v = 0;
+            for (unsigned i = 0; i < len; ++i) v |= std::uint64_t(static_cast< unsigned char >(z[pos + i])) << (8 * i);
+            return v;
+        };
+        auto put = [] (std::string& t, std::size_t pos, unsigned len, std::uint64_t v) {
+            for (unsigned i = 0; i < len; ++i) t[pos + i] = static_cast< char >(v >> (8 * i));
+        };
+        std::size_t index_offset = get(z.size() - 24, 8);
+        // the first entry has the smallest key, ""
+        std::size_t block_offset = get(index_offset, 8);
+        std::size_t block_size = get(index_offset + 20, 4);
+        // footer: index offset; entry: key offset, key length, block offset, block size; block: ISIZE
+        std::vector< std::pair< std::size_t, unsigned > > field_v = {
+            { z.size() - 24, 8 }, { index_offset + 8, 8 }, { index_offset + 16, 4 },
+            { index_offset, 8 }, { index_offset + 20, 4 }, { block_offset + block_size - 4, 4 } };
+        for (const auto& f : field_v)
+        {
+            std::string t = z;
+            put(t, f.first, f.second, 0xFFFFFFF0);
+            std::stringstream ss(t);
+            std::string rec;
+            CHECK_THROWS_AS( zstr::record_reader(ss.rdbuf()).find("", rec), const zstr::Exception & );
+        }
+    }
+    SECTION("empty container")
+    {
+        std::stringstream ss;
+        {
+            zstr::record_writer wr(ss.rdbuf());
+        }
+        zstr::record_reader rdr(ss.rdbuf());
+        std::string rec;
+        CHECK( rdr.size() == 0 );
+        CHECK( not rdr.find("a", rec) );
+    }
+    std::remove(fn.c_str());
+}
+
+TEST_CASE("line reader", "[line_reader]")
+{
+    std::string s = make_text(300000);
+    for (const std::string& t : { s, s + "\n", std::string("\n\nab\n\n"), std::string("x"), std::string("") })
+    {
+        std::vector< std::string > expected;
+        {
+            std::istringstream iss(t);
+            std::string line;
+            while (std::getline(iss, line)) expected.push_back(line);
+        }
+        for (const std::string& z : { t, compress(t, 1 << 16, 0) })
+        {
+            for (std::size_t buff_size : { 1 << 4, 1 << 10, 1 << 20 })
+            {
+                std::istringstream iss(z);
+                zstr::istreambuf zsbuf(iss.rdbuf(), buff_size);
+                zstr::line_reader lr(zsbuf);
+                zstr::line_reader::line l;
+                std::vector< std::string > v;
+                while (lr.next(l)) v.push_back(l.str());
+                CHECK( v == expected );
+                CHECK( not lr.next(l) );
+            }
+        }
+    }
+    SECTION("from a zstr::istream")
+    {
+        std::istringstream iss(compress(s, 1 << 16, 0));
+        zstr::istream is(iss);
+        zstr::line_reader lr(is);
+        zstr::line_reader::line l;
+        REQUIRE( lr.next(l) );
+        CHECK( l.str() == s.substr(0, s.find('\n')) );
+        CHECK_THROWS_AS( zstr::line_reader lr2(iss), const zstr::Exception & );
+    }
+}
+
+TEST_CASE("fastx reader", "[fastx_reader]")
+{
+    std::mt19937 rg(7);
+    std::vector< zstr::fastx_reader::record > rec_v(2000);
+    std::string fq;
+    std::string fa;
+    for (std::size_t i = 0; i < rec_v.size(); ++i)
+    {
+        auto & r = rec_v[i];
+        r.name = "read" + std::to_string(i) + " len=" + std::to_string(i % 300);
+        for (std::size_t j = 0; j < i % 300; ++j)
+        {
+            r.seq += "ACGT"[rg() % 4];
+            r.qual += static_cast< char >('!' + rg() % 40);
+        }
+        fq += "@" + r.name + "\n" + r.seq + "\n+\n" + r.qual + "\n";
+        fa += ">" + r.name + "\n";
+        // multi-line FASTA sequences, 60 bases per line
+        for (std::size_t j = 0; j < r.seq.size(); j += 60) fa += r.seq.substr(j, 60) + "\n";
+    }
+    for (bool fastq : { true, false })
+    {
+        const std::string & t = fastq? fq : fa;
+        std::vector< std::string > expected;
+        for (const auto& r : rec_v) expected.push_back(r.name + "\t" + r.seq + "\t" + (fastq? r.qual : ""));
+        // with and without a final newline
+        for (const std::string& z : { t, compress(t, 1 << 16, 0), t.substr(0, t.size() - 1) })
+        {
+            for (std::size_t buff_size : { 1 << 6, 1 << 12, 1 << 20 })
+            {
+                std::istringstream iss(z);
+                zstr::istreambuf zsbuf(iss.rdbuf(), buff_size);
+                zstr::fastx_reader rdr(zsbuf);
+                zstr::fastx_reader::record r;
+                std::vector< std::string > v;
+                while (rdr.next(r)) v.push_back(r.name + "\t" + r.seq + "\t" + r.qual);
+                CHECK( v == expected );
+            }
+        }
+    }
+    SECTION("pfor input")
+    {
+        std::istringstream iss(compress(fq, 1 << 16, 0));
+        zstr::istream is(iss);
+        zstr::fastx_reader rdr(is);
+        std::mutex mtx;
+        std::size_t total = 0;
+        pfor::pfor< zstr::fastx_reader::record >(
+            2, 50,
+            [&] (zstr::fastx_reader::record& r) { return rdr.next(r); },
+            [&] (zstr::fastx_reader::record& r) {
+                std::lock_guard< std::mutex > lg(mtx);
+                total += r.seq.size();
+            });
+        std::size_t expected = 0;
+        for (const auto& r : rec_v) expected += r.seq.size();
+        CHECK( total == expected );
+    }
+    SECTION("edge records")
+    {
+        // an empty last read without a final newline; a '>' inside a FASTA line
+        for (const std::string& t : { std::string("@a\nAC\n+\nII\n@b\n\n+\n"), std::string(">a\nAC\nG>T\n>b\nTT") })
+        {
+            std::istringstream iss(t);
+            zstr::istreambuf zsbuf(iss.rdbuf());
+            zstr::fastx_reader rdr(zsbuf);
+            zstr::fastx_reader::record r;
+            std::vector< std::string > v;
+            while (rdr.next(r)) v.push_back(r.name + "\t" + r.seq + "\t" + r.qual);
+            std::vector< std::string > expected = (t[0] == '@'
+                                                   ? std::vector< std::string >{ "a\tAC\tII", "b\t\t" }
+                                                   : std::vector< std::string >{ "a\tACG>T\t", "b\tTT\t" });
+            CHECK( v == expected );
+        }
+    }
+    SECTION("invalid input")
+    {
+        for (const std::string& t : { std::string("ACGT\n"), std::string("@r\nACGT\n+\nII\n"), std::string("@r\nACGT\n") })
+        {
+            std::istringstream iss(t);
+            zstr::istreambuf zsbuf(iss.rdbuf());
+            zstr::fastx_reader rdr(zsbuf);
+            zstr::fastx_reader::record_view r;
+            CHECK_THROWS_AS( rdr.next(r), const zstr::Exception & );
+        }
+    }
+}
@@ -1,14 +1,33 @@
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <memory>
+#include "tpool.hpp"
 #include "zstr.hpp"
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 void usage(std::ostream& os, const std::string& prog_name)
 {
-    os << "Use: " << prog_name << " [-c] [-o output_file] files..." << std::endl
+    os << "Use: " << prog_name << " [-c] [-b|-z|-l|-D dict_file] [-p threads] [-o output_file] files..." << std::endl
        << "Synposis:" << std::endl
-       << "  Decompress (with `-c`, compress) files to stdout (with `-o`, to output_file)." << std::endl;
+       << "  Decompress (with `-c`, compress) files to stdout (with `-o`, to output_file)." << std::endl
+       << "  With `-p`, process that many files at once, writing their output in order; each" << std::endl
+       << "  file is then compressed separately, as one gzip member (or BGZF stream, or frame)." << std::endl
+       << "  A single file is instead (de)compressed by that many threads." << std::endl
+       << "  With `-b`, compress in BGZF format." << std::endl
+       << "  With `-z`, compress in zstd format (requires ZSTR_WITH_ZSTD)." << std::endl
+       << "  With `-l`, compress in LZ4 frame format (requires ZSTR_WITH_LZ4)." << std::endl
+       << "  With `-D`, compress to (or decompress from) raw deflate, with a preset dictionary" << std::endl
+       << "  (see zdict)." << std::endl;
 }
 
 void cat_stream(std::istream& is, std::ostream& os)
@@ -25,7 +44,239 @@ void cat_stream(std::istream& is, std::ostream& os)
     delete [] buff;
 } // cat_stream
 
-void decompress_files(const std::vector< std::string >& file_v, const std::string& output_file)
+void cat_blocks(zstr::istreambuf& zsbuf, std::ostream& os)
+{
+    // write the decompressed data straight from the zstr buffers, or from the
+    // mapping of an uncompressed file
+    while (true)
+    {
+        auto blk = zsbuf.next_block();
+        if (blk.second == 0) break;
+        os.write(blk.first, blk.second);
+    }
+} // cat_blocks
+
+// Copy an uncompressed file to stdout in the kernel: with copy_file_range()
+// if stdout is a file, or with splice() if it is a pipe. Return false if
+// this does not apply, and the file should be read through streams.
+bool kernel_copy(const std::string& f)
+{
+#ifdef __linux__
+    int in_fd = ::open(f.c_str(), O_RDONLY);
+    if (in_fd < 0) return false;
+    struct stat in_st, out_st;
+    if (::fstat(in_fd, &in_st) != 0 or not S_ISREG(in_st.st_mode)
+        or ::fstat(STDOUT_FILENO, &out_st) != 0 or not (S_ISREG(out_st.st_mode) or S_ISFIFO(out_st.st_mode)))
+    {
+        ::close(in_fd);
+        return false;
+    }
+    auto fail = [&] (const std::string& msg) {
+        std::string err = std::strerror(errno);
+        ::close(in_fd);
+        throw std::runtime_error("zc: " + msg + ": " + err);
+    };
+    char head[4];
+    ssize_t head_size;
+    while ((head_size = ::pread(in_fd, head, sizeof(head), 0)) < 0 and errno == EINTR) {}
+    if (head_size < 0) fail("error reading: " + f);
+    if (zstr::istreambuf::is_compressed(head, head_size))
+    {
+        ::close(in_fd);
+        return false;
+    }
+    std::cout.flush();
+    loff_t off = 0;
+    while (off < in_st.st_size)
+    {
+        ssize_t cnt = (S_ISREG(out_st.st_mode)
+                       ? ::copy_file_range(in_fd, &off, STDOUT_FILENO, nullptr, in_st.st_size - off, 0)
+                       : ::splice(in_fd, &off, STDOUT_FILENO, nullptr, in_st.st_size - off, SPLICE_F_MORE));
+        if (cnt <= 0) break;
+    }
+    // not supported (e.g. across file systems), or interrupted: copy the rest with read/write
+    std::vector< char > buff(1 << 16);
+    while (off < in_st.st_size)
+    {
+        ssize_t cnt = ::pread(in_fd, buff.data(), buff.size(), off);
+        if (cnt < 0 and errno == EINTR) continue;
+        if (cnt < 0) fail("error reading: " + f);
+        if (cnt == 0) break;
+        for (ssize_t done = 0; done < cnt; )
+        {
+            ssize_t w = ::write(STDOUT_FILENO, buff.data() + done, cnt - done);
+            if (w < 0 and errno == EINTR) continue;
+            if (w <= 0) fail("write error");
+            done += w;
+        }
+        off += cnt;
+    }
+    ::close(in_fd);
+    return true;
+#else
+    (void)f;
+    return false;
+#endif
+} // kernel_copy
+
+// Output of one file, produced by a worker thread in chunks, and written to
+// the sink by the main thread, in file order. The worker blocks when
+// max_chunks chunks are waiting, which bounds the memory used by files
+// processed ahead of the one being written.
+class ordered_output
+    : public std::streambuf
+{
+public:
+    ordered_output(std::size_t _chunk_size = 1 << 20, std::size_t _max_chunks = 4)
+        : chunk_size(_chunk_size), max_chunks(_max_chunks), done(false), abandoned(false)
+    {
+        new_chunk();
+    }
+
+    // Producer: flush the last chunk, and mark the end of the output, or the
+    // error which ended it.
+    void close(const std::string& _err = std::string())
+    {
+        sync();
+        std::unique_lock< std::mutex > l(mtx);
+        done = true;
+        err = _err;
+        cv.notify_all();
+    }
+
+    // Consumer: write the chunks to os as they come, until the end of the
+    // output. Rethrow the producer error, if any.
+    void drain(std::ostream& os)
+    {
+        std::string chunk;
+        while (true)
+        {
+            {
+                std::unique_lock< std::mutex > l(mtx);
+                while (q.empty() and not done) cv.wait(l);
+                if (q.empty())
+                {
+                    if (not err.empty()) throw std::runtime_error(err);
+                    return;
+                }
+                chunk = std::move(q.front());
+                q.pop_front();
+                cv.notify_all();
+            }
+            os.write(chunk.data(), chunk.size());
+        }
+    }
+
+    // Consumer: give up on this output, and discard the rest of it.
+    void abandon()
+    {
+        std::unique_lock< std::mutex > l(mtx);
+        abandoned = true;
+        q.clear();
+        cv.notify_all();
+    }
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        push();
+        return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::not_eof(c) : sputc(c);
+    }
+    int sync() override
+    {
+        if (pptr() > pbase()) push();
+        return 0;
+    }
+
+private:
+    void new_chunk()
+    {
+        buff.assign(chunk_size, '\0');
+        setp(&buff[0], &buff[0] + buff.size());
+    }
+
+    void push()
+    {
+        buff.resize(pptr() - pbase());
+        {
+            std::unique_lock< std::mutex > l(mtx);
+            while (q.size() >= max_chunks and not abandoned) cv.wait(l);
+            if (not abandoned) q.push_back(std::move(buff));
+            cv.notify_all();
+        }
+        new_chunk();
+    }
+
+    std::string buff;
+    std::deque< std::string > q;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::size_t chunk_size;
+    std::size_t max_chunks;
+    bool done;
+    bool abandoned;
+    std::string err;
+}; // class ordered_output
+
+// Process files on a pool of threads, with at most that many in flight, and
+// write their output to os in order. process_file(f, sbuf) writes the output
+// of file f to sbuf.
+template < typename Function >
+void process_files_parallel(const std::vector< std::string >& file_v, std::ostream& os, unsigned threads,
+                            Function process_file)
+{
+    tpool::tpool pool(threads);
+    std::deque< std::unique_ptr< ordered_output > > out_q;
+    std::size_t next = 0;
+    try
+    {
+        while (next < file_v.size() or not out_q.empty())
+        {
+            while (next < file_v.size() and out_q.size() < threads)
+            {
+                ordered_output * out_p = new ordered_output();
+                out_q.emplace_back(out_p);
+                const std::string * f_p = &file_v[next++];
+                pool.add_job([&process_file, f_p, out_p] (unsigned) {
+                        std::string err;
+                        try
+                        {
+                            process_file(*f_p, out_p);
+                        }
+                        catch (std::exception& e)
+                        {
+                            err = *f_p + ": " + e.what();
+                        }
+                        out_p->close(err);
+                    });
+            }
+            out_q.front()->drain(os);
+            out_q.pop_front();
+        }
+    }
+    catch (...)
+    {
+        // let the jobs in flight finish before their outputs go away
+        for (auto& out_p : out_q) out_p->abandon();
+        pool.wait_jobs();
+        throw;
+    }
+    pool.wait_jobs();
+} // process_files_parallel
+
+// Open an input file, or stdin, for decompression; with dict_p set, of raw deflate data.
+std::unique_ptr< std::istream > open_input(const std::string& f, unsigned threads, const std::string * dict_p)
+{
+    std::unique_ptr< std::istream > is_p =
+        (f != "-"
+         ? std::unique_ptr< std::istream >(new zstr::ifstream(f, std::ios_base::in, threads, true))
+         : std::unique_ptr< std::istream >(new zstr::istream(std::cin, threads)));
+    if (dict_p) static_cast< zstr::istreambuf * >(is_p->rdbuf())->set_dictionary(*dict_p);
+    return is_p;
+} // open_input
+
+void decompress_files(const std::vector< std::string >& file_v, const std::string& output_file,
+                      unsigned threads, const std::string * dict_p)
 {
     //
     // Set up sink ostream
@@ -38,33 +289,76 @@ void decompress_files(const std::vector< std::string >& file_v, const std::strin
         os_p = ofs_p.get();
     }
     //
+    // Process several files at once
+    //
+    if (threads > 1 and file_v.size() > 1)
+    {
+        process_files_parallel(file_v, *os_p, threads, [dict_p] (const std::string& f, std::streambuf * sbuf_p) {
+                std::ostream os(sbuf_p);
+                std::unique_ptr< std::istream > is_p = open_input(f, 0, dict_p);
+                cat_blocks(*static_cast< zstr::istreambuf * >(is_p->rdbuf()), os);
+            });
+        return;
+    }
+    //
     // Process files
     //
     for (const auto& f : file_v)
     {
         //
-        // If `f` is a file, create a zstr::ifstream, else (it is stdin) create a zstr::istream wrapper
+        // Uncompressed files going to stdout are copied by the kernel
+        //
+        if (f != "-" and output_file.empty() and not dict_p and kernel_copy(f)) continue;
         //
-        std::unique_ptr< std::istream > is_p =
-            (f != "-"
-             ? std::unique_ptr< std::istream >(new zstr::ifstream(f))
-             : std::unique_ptr< std::istream >(new zstr::istream(std::cin)));
+        // If `f` is a file, create a (memory-mapped) zstr::ifstream, else (it is stdin) create a zstr::istream wrapper;
+        // a single input may be decompressed in parallel
+        //
+        std::unique_ptr< std::istream > is_p = open_input(f, threads > 1? threads : 0, dict_p);
         //
         // Cat stream
         //
-        cat_stream(*is_p, *os_p);
+        cat_blocks(*static_cast< zstr::istreambuf * >(is_p->rdbuf()), *os_p);
     }
 } // decompress_files
 
-void compress_files(const std::vector< std::string >& file_v, const std::string& output_file)
+void compress_files(const std::vector< std::string >& file_v, const std::string& output_file,
+                    zstr::format fmt, unsigned threads, const std::string * dict_p)
 {
     //
-    // Set up compression sink ostream
+    // Compress several files at once, each into its own gzip member (or BGZF stream, or frame)
+    //
+    if (threads > 1 and file_v.size() > 1)
+    {
+        std::unique_ptr< std::ofstream > ofs_p;
+        std::ostream * sink_p = &std::cout;
+        if (not output_file.empty())
+        {
+            ofs_p = std::unique_ptr< std::ofstream >(new strict_fstream::ofstream(output_file, std::ios_base::binary));
+            sink_p = ofs_p.get();
+        }
+        process_files_parallel(file_v, *sink_p, threads, [fmt, dict_p] (const std::string& f, std::streambuf * sbuf_p) {
+                zstr::ostream os(sbuf_p, 0, fmt);
+                if (dict_p) static_cast< zstr::ostreambuf * >(os.rdbuf())->set_dictionary(*dict_p);
+                std::unique_ptr< std::ifstream > ifs_p;
+                std::istream * is_p = &std::cin;
+                if (f != "-")
+                {
+                    ifs_p = std::unique_ptr< std::ifstream >(new strict_fstream::ifstream(f));
+                    is_p = ifs_p.get();
+                }
+                cat_stream(*is_p, os);
+            });
+        return;
+    }
+    //
+    // Set up compression sink ostream; a single input is compressed by parallel blocks
     //
+    unsigned comp_threads = threads > 1? threads : 0;
     std::unique_ptr< std::ostream > os_p =
         (not output_file.empty()
-         ? std::unique_ptr< std::ostream >(new zstr::ofstream(output_file))
-         : std::unique_ptr< std::ostream >(new zstr::ostream(std::cout)));
+         ? std::unique_ptr< std::ostream >(new zstr::ofstream(output_file, std::ios_base::out, comp_threads, fmt))
+         : std::unique_ptr< std::ostream >(new zstr::ostream(std::cout, comp_threads, fmt)));
+    if (dict_p) static_cast< zstr::ostreambuf * >(os_p->rdbuf())->set_dictionary(*dict_p);
     //
     // Process files
     //
@@ -90,15 +384,39 @@ void compress_files(const std::vector< std::string >& file_v, const std::string&
 int main(int argc, char * argv[])
 {
     bool compress = false;
+    zstr::format fmt = zstr::format::gzip;
     std::string output_file;
+    unsigned threads = 0;
+    std::unique_ptr< std::string > dict_p;
     int c;
-    while ((c = getopt(argc, argv, "co:h?")) != -1)
+    while ((c = getopt(argc, argv, "cbzlD:p:o:h?")) != -1)
     {
         switch (c)
         {
         case 'c':
             compress = true;
             break;
+        case 'b':
+            fmt = zstr::format::bgzf;
+            break;
+        case 'z':
+            fmt = zstr::format::zstd;
+            break;
+        case 'l':
+            fmt = zstr::format::lz4;
+            break;
+        case 'D':
+            {
+                fmt = zstr::format::raw;
+                strict_fstream::ifstream ifs(optarg, std::ios_base::binary);
+                std::ostringstream oss;
+                oss << ifs.rdbuf();
+                dict_p = std::unique_ptr< std::string >(new std::string(oss.str()));
+            }
+            break;
+        case 'p':
+            threads = std::stoul(optarg);
+            break;
         case 'o':
             if (std::string("-") != optarg)
             {
@@ -128,10 +446,10 @@ int main(int argc, char * argv[])
     //
     if (compress)
     {
-        compress_files(file_v, output_file);
+        compress_files(file_v, output_file, fmt, threads, dict_p.get());
     }
     else
     {
-        decompress_files(file_v, output_file);
+        decompress_files(file_v, output_file, threads, dict_p.get());
     }
 }
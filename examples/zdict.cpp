@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "zstr.hpp"
+
+void usage(std::ostream& os, const std::string& prog_name)
+{
+    os << "Use: " << prog_name << " [-l] [-s dict_size] [-g segment_size] [-k kmer_size] [-o output_file] files..." << std::endl
+       << "Synposis:" << std::endl
+       << "  Train a preset dictionary for raw deflate records (see zstr::format::raw) from sample" << std::endl
+       << "  records: each file, or with `-l`, each line of each file. Files may be compressed." << std::endl
+       << "  The dictionary is made of the segment_size byte segments (default: 64) holding the" << std::endl
+       << "  kmer_size byte strings (default: 6) found in the most records, most common last, up" << std::endl
+       << "  to dict_size bytes (default: 32768, the largest deflate window). It is written to" << std::endl
+       << "  stdout (with `-o`, to output_file)." << std::endl;
+}
+
+// Dictionary trainer, after the "cover" algorithm of zstd's dictionary builder
+// (Liao, Petri, Moffat, Wirth: "Effective construction of relative Lempel-Ziv
+// dictionaries", WWW 2016). k-mers are scored by the number of records
+// containing them. The sample data is cut into one epoch per segment of the
+// dictionary; from each epoch, the segment with the highest total score of
+// its k-mers is picked, and the score of those k-mers is cleared, so that
+// later segments cover new content.
+class trainer
+{
+public:
+    trainer(std::size_t _dict_size, std::size_t _seg_size, std::size_t _k)
+        : dict_size(_dict_size), seg_size(_seg_size), k(_k), n_records(0)
+    {
+        if (k < 1 or k > 8 or seg_size < k) throw std::invalid_argument("zdict: need 1 <= kmer_size <= 8, segment_size");
+    }
+
+    void add_record(const std::string& rec)
+    {
+        ++n_records;
+        for (std::size_t i = 0; i + k <= rec.size(); ++i)
+        {
+            kmer_info& ki = kmer_m[kmer(&rec[i])];
+            if (ki.last_record != n_records)
+            {
+                ki.last_record = n_records;
+                ++ki.score;
+            }
+        }
+        data += rec;
+    }
+
+    std::string train()
+    {
+        struct segment
+        {
+            std::size_t pos;
+            std::uint64_t score;
+        };
+        std::vector< segment > seg_v;
+        std::size_t n_epochs = std::max< std::size_t >(1, dict_size / seg_size);
+        std::size_t epoch_size = std::max(seg_size, data.size() / n_epochs);
+        for (std::size_t start = 0; start + seg_size <= data.size() and seg_v.size() < n_epochs; start += epoch_size)
+        {
+            // slide a segment over the epoch, keeping the total score of its k-mers
+            std::size_t end = std::min(start + epoch_size, data.size());
+            segment best{ start, 0 };
+            std::uint64_t score = 0;
+            for (std::size_t i = start; i + k <= end; ++i)
+            {
+                score += kmer_score(i);
+                if (i >= start + seg_size - k + 1) score -= kmer_score(i - (seg_size - k + 1));
+                if (i + k >= start + seg_size and score > best.score) best = segment{ i + k - seg_size, score };
+            }
+            if (best.score == 0) continue;
+            seg_v.push_back(best);
+            // clear the scores, so other segments cover other k-mers
+            for (std::size_t i = best.pos; i + k <= best.pos + seg_size; ++i) kmer_m[kmer(&data[i])].score = 0;
+        }
+        // the most useful segments go last, closest to the records
+        std::stable_sort(seg_v.begin(), seg_v.end(), [] (const segment& a, const segment& b) { return a.score < b.score; });
+        std::string dict;
+        for (const auto& seg : seg_v) dict.append(data, seg.pos, seg_size);
+        if (dict.size() > dict_size) dict.erase(0, dict.size() - dict_size);
+        return dict;
+    }
+
+private:
+    struct kmer_info
+    {
+        kmer_info() : score(0), last_record(0) {}
+        std::uint64_t score;
+        std::uint64_t last_record;
+    };
+
+    std::uint64_t kmer(const char * p) const
+    {
+        std::uint64_t res = 0;
+        for (std::size_t i = 0; i < k; ++i) res = (res << 8) | static_cast< unsigned char >(p[i]);
+        return res;
+    }
+
+    std::uint64_t kmer_score(std::size_t pos) const
+    {
+        auto it = kmer_m.find(kmer(&data[pos]));
+        return it != kmer_m.end()? it->second.score : 0;
+    }
+
+    std::size_t dict_size;
+    std::size_t seg_size;
+    std::size_t k;
+    std::uint64_t n_records;
+    std::string data;
+    std::unordered_map< std::uint64_t, kmer_info > kmer_m;
+}; // class trainer
+
+int main(int argc, char * argv[])
+{
+    bool lines = false;
+    std::size_t dict_size = 32768;
+    std::size_t seg_size = 64;
+    std::size_t k = 6;
+    std::string output_file;
+    int c;
+    while ((c = getopt(argc, argv, "ls:g:k:o:h?")) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            lines = true;
+            break;
+        case 's':
+            dict_size = std::stoul(optarg);
+            break;
+        case 'g':
+            seg_size = std::stoul(optarg);
+            break;
+        case 'k':
+            k = std::stoul(optarg);
+            break;
+        case 'o':
+            output_file = optarg;
+            break;
+        case '?':
+        case 'h':
+            usage(std::cout, argv[0]);
+            std::exit(EXIT_SUCCESS);
+            break;
+        default:
+            usage(std::cerr, argv[0]);
+            std::exit(EXIT_FAILURE);
+        }
+    }
+    std::vector< std::string > file_v(&argv[optind], &argv[argc]);
+    if (file_v.empty()) file_v.push_back("-");
+    trainer tr(dict_size, seg_size, k);
+    for (const auto& f : file_v)
+    {
+        std::unique_ptr< std::istream > is_p =
+            (f != "-"
+             ? std::unique_ptr< std::istream >(new zstr::ifstream(f))
+             : std::unique_ptr< std::istream >(new zstr::istream(std::cin)));
+        std::string rec;
+        if (lines)
+        {
+            while (std::getline(*is_p, rec)) tr.add_record(rec + "\n");
+        }
+        else
+        {
+            std::ostringstream oss;
+            oss << is_p->rdbuf();
+            tr.add_record(oss.str());
+        }
+    }
+    std::string dict = tr.train();
+    if (output_file.empty())
+    {
+        std::cout.write(dict.data(), dict.size());
+    }
+    else
+    {
+        strict_fstream::ofstream ofs(output_file, std::ios_base::binary);
+        ofs.write(dict.data(), dict.size());
+    }
+}
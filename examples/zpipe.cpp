@@ -10,25 +10,16 @@ int main()
     //
     zstr::istreambuf zsbuf(std::cin.rdbuf(), 1<<16, true);
     //
-    // Create an std::istream wrapper for the zstr::streambuf.
-    // NOTE: A zstr::istream constructed with a zstr::streambuf parameter would decompress twice.
-    //
-    std::istream is(&zsbuf);
-    //
-    // Turn on error reporting (otherwise, zstream exceptions are hidden).
-    //
-    is.exceptions(std::ios_base::badbit);
-    //
     // Main loop
     //
-    const std::streamsize buff_size = 1 << 16;
-    char * buff = new char [buff_size];
+    // Instead of wrapping the zstr::streambuf in an std::istream, and copying
+    // the data with read(), use the blocks of uncompressed data in place.
+    // NOTE: Errors are reported by zstr::Exception.
+    //
     while (true)
     {
-        is.read(buff, buff_size);
-        std::streamsize cnt = is.gcount();
-        if (cnt == 0) break;
-        std::cout.write(buff, cnt);
+        auto blk = zsbuf.next_block();
+        if (blk.second == 0) break;
+        std::cout.write(blk.first, blk.second);
     }
-    delete [] buff;
 }
@@ -9,11 +9,15 @@ int main()
     //
     zstr::istream is(std::cin);
     //
+    // Read lines in place, without getline() copies.
+    //
+    zstr::line_reader lr(is);
+    zstr::line_reader::line l;
+    //
     // Main loop
     //
-    std::string s;
-    while (getline(is, s))
+    while (lr.next(l))
     {
-        std::cout << s << std::endl;
+        std::cout.write(l.data, l.size) << '\n';
     }
 }
@@ -39,7 +39,9 @@ static std::string strerror()
     std::string tmp(p, std::strlen(p));
     std::swap(buff, tmp);
 #endif
-    buff.resize(buff.find('\0'));
+    // the GNU version may return a static string, with no terminating '\0' in buff
+    std::size_t len = buff.find('\0');
+    if (len != std::string::npos) buff.resize(len);
     return buff;
 }
 
@@ -9,12 +9,62 @@
 #ifndef __ZSTR_HPP
 #define __ZSTR_HPP
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
 #include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <new>
+#include <queue>
 #include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 #include <zlib.h>
 #include "strict_fstream.hpp"
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Zstandard support requires libzstd: compile with -DZSTR_WITH_ZSTD and link with -lzstd
+#ifdef ZSTR_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+// LZ4 support requires liblz4: compile with -DZSTR_WITH_LZ4 and link with -llz4
+#ifdef ZSTR_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+// BGZF blocks are (de)compressed with libdeflate if compiled with
+// -DZSTR_WITH_LIBDEFLATE and linked with -ldeflate; zlib is used otherwise.
+// NOTE: zlib-ng in zlib-compatible mode needs no change: link with it instead of zlib.
+#ifdef ZSTR_WITH_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// io_uring support (see uring_streambuf) needs Linux 5.6 and its kernel
+// headers, but no library: compile with -DZSTR_WITH_IO_URING.
+#ifdef ZSTR_WITH_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+// Counters on istreambuf and ostreambuf (see stream_stats) are only kept if
+// compiled with -DZSTR_WITH_STATS; otherwise, they cost nothing.
+
 namespace zstr
 {
 
@@ -49,7 +99,7 @@ public:
             _msg += "[" + oss.str() + "]: ";
             break;
         }
-        _msg += zstrm_p->msg;
+        if (zstrm_p->msg) _msg += zstrm_p->msg;
     }
     Exception(const std::string msg) : _msg(msg) {}
     const char * what() const noexcept { return _msg.c_str(); }
@@ -57,29 +107,280 @@ private:
     std::string _msg;
 }; // class Exception
 
+/// Output formats supported by ostreambuf.
+enum class format
+{
+    gzip,   ///< a single gzip member, restarted on each sync()
+    bgzf,   ///< blocked gzip, as used by samtools/htslib
+    zstd,   ///< a single Zstandard frame, restarted on each sync(); requires ZSTR_WITH_ZSTD
+    lz4,    ///< a single LZ4 frame, restarted on each sync(); requires ZSTR_WITH_LZ4
+    raw     ///< raw deflate, without header or checksum, restarted on each sync(); see ostreambuf::set_dictionary()
+};
+
+/// Slab allocator for zlib stream states, used through zalloc()/zfree().
+///
+/// Memory is reserved in slabs of about _slab_size bytes, each cut into
+/// objects of one size. Freed objects are kept for reuse by later requests
+/// of the same size, which is what many streams with the same settings
+/// make. With _max_bytes > 0, no more than that many bytes are reserved;
+/// allocations beyond that fail, and so does the zlib call that needs them.
+/// The allocator must outlive the streams that use it.
+class slab_allocator
+{
+public:
+    explicit slab_allocator(std::size_t _max_bytes = 0, std::size_t _slab_size = (std::size_t)1 << 20)
+        : max_bytes(_max_bytes), slab_size(_slab_size), reserved_bytes(0), used_bytes(0) {}
+
+    slab_allocator(const slab_allocator &) = delete;
+    slab_allocator & operator = (const slab_allocator &) = delete;
+
+    ~slab_allocator()
+    {
+        for (auto p : slab_v) delete [] p;
+    }
+
+    /// Return null if the memory limit would be exceeded.
+    void * allocate(std::size_t size)
+    {
+        // each object starts with a header holding its size
+        std::size_t sz = (size + 2 * header_size - 1) / header_size * header_size;
+        std::lock_guard< std::mutex > lk(mtx);
+        std::vector< char * > & free_v = free_m[sz];
+        if (free_v.empty())
+        {
+            std::size_t cnt = std::max< std::size_t >(slab_size / sz, 1);
+            if (max_bytes > 0 and reserved_bytes + sz > max_bytes) return nullptr;
+            if (max_bytes > 0) cnt = std::min(cnt, (max_bytes - reserved_bytes) / sz);
+            char * slab = new (std::nothrow) char [cnt * sz];
+            if (not slab) return nullptr;
+            slab_v.push_back(slab);
+            reserved_bytes += cnt * sz;
+            for (std::size_t i = cnt; i > 0; --i) free_v.push_back(slab + (i - 1) * sz);
+        }
+        char * p = free_v.back();
+        free_v.pop_back();
+        used_bytes += sz;
+        *reinterpret_cast< std::size_t * >(p) = sz;
+        return p + header_size;
+    }
+
+    void deallocate(void * ptr)
+    {
+        if (not ptr) return;
+        char * p = static_cast< char * >(ptr) - header_size;
+        std::size_t sz = *reinterpret_cast< std::size_t * >(p);
+        std::lock_guard< std::mutex > lk(mtx);
+        free_m[sz].push_back(p);
+        used_bytes -= sz;
+    }
+
+    /// Bytes held by the slabs.
+    std::size_t reserved()
+    {
+        std::lock_guard< std::mutex > lk(mtx);
+        return reserved_bytes;
+    }
+    /// Bytes in allocated objects, including headers.
+    std::size_t in_use()
+    {
+        std::lock_guard< std::mutex > lk(mtx);
+        return used_bytes;
+    }
+
+    // zlib hooks, with the allocator as opaque pointer
+    static voidpf zalloc(voidpf opaque, uInt items, uInt size)
+    {
+        return static_cast< slab_allocator * >(opaque)->allocate(static_cast< std::size_t >(items) * size);
+    }
+    static void zfree(voidpf opaque, voidpf address)
+    {
+        static_cast< slab_allocator * >(opaque)->deallocate(address);
+    }
+
+private:
+    static const std::size_t header_size = 16;
+
+    std::mutex mtx;
+    std::map< std::size_t, std::vector< char * > > free_m;
+    std::vector< char * > slab_v;
+    std::size_t max_bytes;
+    std::size_t slab_size;
+    std::size_t reserved_bytes;
+    std::size_t used_bytes;
+}; // class slab_allocator
+
+/// Memory settings of an istreambuf or ostreambuf, for programs that keep
+/// many streams open at once.
+///
+/// The deflate state takes about 2^(window_bits+2) + 2^(mem_level+9) bytes
+/// (256KB with the defaults), plus the I/O buffers. Inflate always uses the
+/// 32KB window needed to read any gzip input, so window_bits and mem_level
+/// only apply to sequential gzip output. With lazy set, buffers and zlib
+/// state are only allocated on first use. With alloc_p set, zlib state is
+/// allocated from that slab allocator.
+struct memory_profile
+{
+    explicit memory_profile(std::size_t _buff_size = (std::size_t)1 << 20, int _window_bits = 15,
+                            int _mem_level = 8, bool _lazy = false, slab_allocator * _alloc_p = nullptr)
+        : buff_size(_buff_size), window_bits(_window_bits), mem_level(_mem_level),
+          lazy(_lazy), alloc_p(_alloc_p) {}
+
+    /// About 64KB per gzip output stream, for a slightly worse compression ratio.
+    static memory_profile low(slab_allocator * _alloc_p = nullptr)
+    {
+        return memory_profile((std::size_t)1 << 14, 12, 4, true, _alloc_p);
+    }
+
+    std::size_t buff_size;      ///< size of each of the input and output buffers
+    int window_bits;            ///< deflate window size, as a power of 2, in 9..15
+    int mem_level;              ///< deflate hash memory, in 1..9
+    bool lazy;                  ///< allocate on first use
+    slab_allocator * alloc_p;   ///< zlib state allocator; null for the zlib default
+}; // struct memory_profile
+
+/// Counters kept by an istreambuf or ostreambuf, to tell whether time goes
+/// to I/O or to (de)compression. They are only updated when compiled with
+/// ZSTR_WITH_STATS, and stay 0 otherwise.
+///
+/// Bytes in are read from the source (istreambuf), or written by the user
+/// (ostreambuf); bytes out are returned to the user, or written to the sink.
+/// io_ns is the time spent waiting on the underlying streambuf, or on an
+/// in-place source; codec_ns is the time spent in zlib, zstd or lz4, or,
+/// with worker threads, waiting for them. Members are gzip or zlib members
+/// ended by sequential decompression, or gzip members written (not counting
+/// BGZF blocks). With write-behind, the counters are updated by the
+/// background thread, and should only be read after sync().
+struct stream_stats
+{
+    stream_stats() : bytes_in(0), bytes_out(0), members(0), calls(0), io_ns(0), codec_ns(0) {}
+
+    std::uint64_t bytes_in;
+    std::uint64_t bytes_out;
+    std::uint64_t members;
+    std::uint64_t calls;        ///< underflow() or overflow() calls
+    std::uint64_t io_ns;
+    std::uint64_t codec_ns;
+}; // struct stream_stats
+
 namespace detail
 {
 
+#ifdef ZSTR_WITH_STATS
+static const bool stats_enabled = true;
+#else
+static const bool stats_enabled = false;
+#endif
+
+/// Add the time spent in a scope to a nanosecond counter, only with
+/// ZSTR_WITH_STATS.
+class stats_timer
+{
+public:
+#ifdef ZSTR_WITH_STATS
+    explicit stats_timer(std::uint64_t & _ns) : ns(_ns), start(std::chrono::steady_clock::now()) {}
+    ~stats_timer()
+    {
+        ns += std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now() - start).count();
+    }
+private:
+    std::uint64_t & ns;
+    std::chrono::steady_clock::time_point start;
+#else
+    explicit stats_timer(std::uint64_t &) {}
+#endif
+}; // class stats_timer
+
+/// Unbuffered pass-through to another streambuf, which counts the bytes read
+/// and written, and the time spent, in a stream_stats. Used by istreambuf
+/// and ostreambuf with ZSTR_WITH_STATS, in front of their underlying
+/// streambuf, so that all their I/O is counted, including that done by
+/// worker and write-behind threads.
+class stats_streambuf
+    : public std::streambuf
+{
+public:
+    stats_streambuf(std::streambuf * _sbuf_p, stream_stats & _st)
+        : sbuf_p(_sbuf_p), st(_st) {}
+
+protected:
+    virtual std::streamsize xsgetn(char * s, std::streamsize n)
+    {
+        stats_timer t(st.io_ns);
+        std::streamsize sz = sbuf_p->sgetn(s, n);
+        st.bytes_in += sz;
+        return sz;
+    }
+    virtual int_type underflow()
+    {
+        stats_timer t(st.io_ns);
+        return sbuf_p->sgetc();
+    }
+    virtual int_type uflow()
+    {
+        stats_timer t(st.io_ns);
+        int_type c = sbuf_p->sbumpc();
+        if (not traits_type::eq_int_type(c, traits_type::eof())) ++st.bytes_in;
+        return c;
+    }
+    virtual std::streamsize xsputn(const char * s, std::streamsize n)
+    {
+        stats_timer t(st.io_ns);
+        std::streamsize sz = sbuf_p->sputn(s, n);
+        st.bytes_out += sz;
+        return sz;
+    }
+    virtual int_type overflow(int_type c)
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        stats_timer t(st.io_ns);
+        int_type r = sbuf_p->sputc(traits_type::to_char_type(c));
+        if (not traits_type::eq_int_type(r, traits_type::eof())) ++st.bytes_out;
+        return r;
+    }
+    virtual int sync()
+    {
+        stats_timer t(st.io_ns);
+        return sbuf_p->pubsync();
+    }
+    virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                             std::ios_base::openmode which = std::ios_base::in | std::ios_base::out)
+    {
+        return sbuf_p->pubseekoff(off, dir, which);
+    }
+    virtual pos_type seekpos(pos_type pos, std::ios_base::openmode which = std::ios_base::in | std::ios_base::out)
+    {
+        return sbuf_p->pubseekpos(pos, which);
+    }
+
+private:
+    std::streambuf * sbuf_p;
+    stream_stats & st;
+}; // class stats_streambuf
+
 class z_stream_wrapper
     : public z_stream
 {
 public:
-    z_stream_wrapper(bool _is_input = true, int _level = Z_DEFAULT_COMPRESSION)
+    // _window_bits == 0 selects the default framing: gzip output, and
+    // automatic gzip/zlib header detection on input
+    z_stream_wrapper(bool _is_input = true, int _level = Z_DEFAULT_COMPRESSION, int _window_bits = 0,
+                     int _mem_level = 8, slab_allocator * _alloc_p = nullptr)
         : is_input(_is_input)
     {
-        this->zalloc = Z_NULL;
-        this->zfree = Z_NULL;
-        this->opaque = Z_NULL;
+        this->zalloc = _alloc_p? &slab_allocator::zalloc : Z_NULL;
+        this->zfree = _alloc_p? &slab_allocator::zfree : Z_NULL;
+        this->opaque = _alloc_p;
         int ret;
         if (is_input)
         {
             this->avail_in = 0;
             this->next_in = Z_NULL;
-            ret = inflateInit2(this, 15+32);
+            ret = inflateInit2(this, _window_bits != 0? _window_bits : 15+32);
         }
         else
         {
-            ret = deflateInit2(this, _level, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+            ret = deflateInit2(this, _level, Z_DEFLATED, _window_bits != 0? _window_bits : 15+16, _mem_level,
+                               Z_DEFAULT_STRATEGY);
         }
         if (ret != Z_OK) throw Exception(this, ret);
     }
@@ -98,237 +399,4143 @@ private:
     bool is_input;
 }; // class z_stream_wrapper
 
+/// Zstandard counterpart of z_stream_wrapper. Without ZSTR_WITH_ZSTD, the
+/// constructor throws, so the streambufs can refer to it unconditionally.
+class zstd_stream_wrapper
+{
+public:
+    // _threads > 0 sets the number of zstd compression workers; it is
+    // ignored if libzstd was built without multithreading support
+    zstd_stream_wrapper(bool _is_input = true, int _level = Z_DEFAULT_COMPRESSION, unsigned _threads = 0)
+#ifdef ZSTR_WITH_ZSTD
+        : dctx_p(nullptr),
+          cctx_p(nullptr)
+    {
+        if (_is_input)
+        {
+            dctx_p = ZSTD_createDCtx();
+            if (! dctx_p) throw Exception("zstd: cannot create decompression context");
+        }
+        else
+        {
+            cctx_p = ZSTD_createCCtx();
+            if (! cctx_p) throw Exception("zstd: cannot create compression context");
+            // zlib's default level selects zstd's default level
+            if (_level != Z_DEFAULT_COMPRESSION) check(ZSTD_CCtx_setParameter(cctx_p, ZSTD_c_compressionLevel, _level));
+            // frames carry a checksum, like gzip members
+            check(ZSTD_CCtx_setParameter(cctx_p, ZSTD_c_checksumFlag, 1));
+            if (_threads > 0) ZSTD_CCtx_setParameter(cctx_p, ZSTD_c_nbWorkers, _threads);
+        }
+    }
+#else
+    {
+        (void)_is_input; (void)_level; (void)_threads;
+        throw Exception("zstr: zstd support not compiled in (define ZSTR_WITH_ZSTD)");
+    }
+#endif
+    zstd_stream_wrapper(const zstd_stream_wrapper &) = delete;
+    zstd_stream_wrapper & operator = (const zstd_stream_wrapper &) = delete;
+    ~zstd_stream_wrapper()
+    {
+#ifdef ZSTR_WITH_ZSTD
+        ZSTD_freeDCtx(dctx_p);
+        ZSTD_freeCCtx(cctx_p);
+#endif
+    }
+
+    /// Decompress from [in_start, in_end) to [out_start, out_end), advancing
+    /// both start pointers. Concatenated frames are decompressed in sequence.
+    void decompress(char * & in_start, char * in_end, char * & out_start, char * out_end)
+    {
+#ifdef ZSTR_WITH_ZSTD
+        ZSTD_inBuffer in = { in_start, static_cast< std::size_t >(in_end - in_start), 0 };
+        ZSTD_outBuffer out = { out_start, static_cast< std::size_t >(out_end - out_start), 0 };
+        check(ZSTD_decompressStream(dctx_p, &out, &in));
+        in_start += in.pos;
+        out_start += out.pos;
+#else
+        (void)in_start; (void)in_end; (void)out_start; (void)out_end;
+#endif
+    }
+
+    /// Compress from [in_start, in_end) to [out_start, out_end), advancing
+    /// both start pointers. With end set, the current frame is ended once all
+    /// input is consumed. Return the number of bytes still to be flushed.
+    std::size_t compress(const char * & in_start, const char * in_end, char * & out_start, char * out_end,
+                         bool end)
+    {
+#ifdef ZSTR_WITH_ZSTD
+        ZSTD_inBuffer in = { in_start, static_cast< std::size_t >(in_end - in_start), 0 };
+        ZSTD_outBuffer out = { out_start, static_cast< std::size_t >(out_end - out_start), 0 };
+        std::size_t ret = check(ZSTD_compressStream2(cctx_p, &out, &in, end? ZSTD_e_end : ZSTD_e_continue));
+        in_start += in.pos;
+        out_start += out.pos;
+        return ret;
+#else
+        (void)in_start; (void)in_end; (void)out_start; (void)out_end; (void)end;
+        return 0;
+#endif
+    }
+
+    // Ref: https://github.com/facebook/zstd/blob/dev/doc/zstd_compression_format.md
+    static bool is_magic(const char * p)
+    {
+        return std::memcmp(p, "\x28\xB5\x2F\xFD", 4) == 0;
+    }
+
+private:
+#ifdef ZSTR_WITH_ZSTD
+    static std::size_t check(std::size_t ret)
+    {
+        if (ZSTD_isError(ret)) throw Exception(std::string("zstd: ") + ZSTD_getErrorName(ret));
+        return ret;
+    }
+
+    ZSTD_DCtx * dctx_p;
+    ZSTD_CCtx * cctx_p;
+#endif
+}; // class zstd_stream_wrapper
+
+/// LZ4 frame counterpart of z_stream_wrapper. Without ZSTR_WITH_LZ4, the
+/// constructor throws, so the streambufs can refer to it unconditionally.
+class lz4_stream_wrapper
+{
+public:
+    // _buff_size is the largest input passed to compress() at once
+    lz4_stream_wrapper(bool _is_input = true, int _level = Z_DEFAULT_COMPRESSION, std::size_t _buff_size = 0)
+#ifdef ZSTR_WITH_LZ4
+        : dctx_p(nullptr),
+          cctx_p(nullptr),
+          frame_open(false)
+    {
+        if (_is_input)
+        {
+            check(LZ4F_createDecompressionContext(&dctx_p, LZ4F_VERSION));
+        }
+        else
+        {
+            check(LZ4F_createCompressionContext(&cctx_p, LZ4F_VERSION));
+            std::memset(&prefs, 0, sizeof(prefs));
+            // zlib's default level selects LZ4's fast mode; levels above 2 use LZ4-HC
+            prefs.compressionLevel = _level != Z_DEFAULT_COMPRESSION? _level : 0;
+            // frames carry a checksum, like gzip members
+            prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+            out_buff.resize(LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(_buff_size, &prefs));
+        }
+    }
+#else
+    {
+        (void)_is_input; (void)_level; (void)_buff_size;
+        throw Exception("zstr: lz4 support not compiled in (define ZSTR_WITH_LZ4)");
+    }
+#endif
+    lz4_stream_wrapper(const lz4_stream_wrapper &) = delete;
+    lz4_stream_wrapper & operator = (const lz4_stream_wrapper &) = delete;
+    ~lz4_stream_wrapper()
+    {
+#ifdef ZSTR_WITH_LZ4
+        LZ4F_freeDecompressionContext(dctx_p);
+        LZ4F_freeCompressionContext(cctx_p);
+#endif
+    }
+
+    /// Decompress from [in_start, in_end) to [out_start, out_end), advancing
+    /// both start pointers. Concatenated frames are decompressed in sequence.
+    void decompress(char * & in_start, char * in_end, char * & out_start, char * out_end)
+    {
+#ifdef ZSTR_WITH_LZ4
+        std::size_t in_size = in_end - in_start;
+        std::size_t out_size = out_end - out_start;
+        check(LZ4F_decompress(dctx_p, out_start, &out_size, in_start, &in_size, nullptr));
+        in_start += in_size;
+        out_start += out_size;
+#else
+        (void)in_start; (void)in_end; (void)out_start; (void)out_end;
+#endif
+    }
+
+    /// Compress _size bytes, starting a frame if none is open; with _end set,
+    /// also end the frame. The output, of the returned size, is at output().
+    std::size_t compress(const char * _in, std::size_t _size, bool _end)
+    {
+#ifdef ZSTR_WITH_LZ4
+        assert(out_buff.size() >= LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(_size, &prefs));
+        std::size_t sz = 0;
+        if (not frame_open)
+        {
+            sz += check(LZ4F_compressBegin(cctx_p, &out_buff[0], out_buff.size(), &prefs));
+            frame_open = true;
+        }
+        if (_size > 0)
+        {
+            sz += check(LZ4F_compressUpdate(cctx_p, &out_buff[sz], out_buff.size() - sz, _in, _size, nullptr));
+        }
+        if (_end)
+        {
+            // the compressBound() reserve includes the frame end
+            sz += check(LZ4F_compressEnd(cctx_p, &out_buff[sz], out_buff.size() - sz, nullptr));
+            frame_open = false;
+        }
+        return sz;
+#else
+        (void)_in; (void)_size; (void)_end;
+        return 0;
+#endif
+    }
+    const char * output() const { return out_buff.data(); }
+
+    // Ref: https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+    static bool is_magic(const char * p)
+    {
+        return std::memcmp(p, "\x04\x22\x4D\x18", 4) == 0;
+    }
+
+private:
+    std::vector< char > out_buff;
+#ifdef ZSTR_WITH_LZ4
+    static std::size_t check(std::size_t ret)
+    {
+        if (LZ4F_isError(ret)) throw Exception(std::string("lz4: ") + LZ4F_getErrorName(ret));
+        return ret;
+    }
+
+    LZ4F_dctx * dctx_p;
+    LZ4F_cctx * cctx_p;
+    LZ4F_preferences_t prefs;
+    bool frame_open;
+#endif
+}; // class lz4_stream_wrapper
+
+// store the low n bytes of v in little-endian order
+inline void put_le(char * p, std::uint64_t v, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        p[i] = static_cast< char >((v >> (8 * i)) & 0xFF);
+    }
+}
+
+// load n bytes in little-endian order
+inline std::uint64_t get_le(const char * p, int n)
+{
+    std::uint64_t v = 0;
+    for (int i = n - 1; i >= 0; --i)
+    {
+        v = (v << 8) | static_cast< unsigned char >(p[i]);
+    }
+    return v;
+}
+
 } // namespace detail
 
-class istreambuf
-    : public std::streambuf
+/// Checkpoint index for random access into ordinary gzip files (zran-style).
+///
+/// A checkpoint is taken at a deflate block boundary roughly every span bytes
+/// of uncompressed data. It holds the uncompressed and compressed offsets, the
+/// number of bits of the last compressed byte already consumed, and the 32KB
+/// window of uncompressed data that precedes it. Decompression can resume at
+/// any checkpoint, so reaching an uncompressed offset takes inflating at most
+/// span bytes. Checkpoints are recorded by an istreambuf while reading, see
+/// istreambuf::record_index(). In the saved form, the windows are compressed.
+class gzip_index
+{
+public:
+    struct checkpoint
+    {
+        std::uint64_t uoffset;
+        std::uint64_t coffset;
+        int bits;
+        std::string window;
+    }; // struct checkpoint
+
+    const std::vector< checkpoint > & checkpoints() const { return checkpoint_v; }
+
+    void add(checkpoint && cp)
+    {
+        assert(checkpoint_v.empty() or checkpoint_v.back().uoffset <= cp.uoffset);
+        checkpoint_v.push_back(std::move(cp));
+    }
+
+    /// The last checkpoint at or before the given uncompressed offset, or null if there is none.
+    const checkpoint * lookup(std::uint64_t uoffset) const
+    {
+        auto it = std::upper_bound(checkpoint_v.begin(), checkpoint_v.end(), uoffset,
+                                   [] (std::uint64_t u, const checkpoint & cp) { return u < cp.uoffset; });
+        return it == checkpoint_v.begin()? nullptr : &*(it - 1);
+    }
+
+    void save(std::ostream & os) const
+    {
+        char buff[29];
+        os.write(magic(), 8);
+        detail::put_le(buff, checkpoint_v.size(), 8);
+        os.write(buff, 8);
+        for (const auto & cp : checkpoint_v)
+        {
+            uLongf sz = compressBound(cp.window.size());
+            std::string z(sz, '\0');
+            int ret = compress2(reinterpret_cast< Bytef * >(&z[0]), &sz,
+                                reinterpret_cast< const Bytef * >(cp.window.data()), cp.window.size(),
+                                Z_BEST_COMPRESSION);
+            if (ret != Z_OK) throw Exception("zstr: gzip index: compress failed");
+            detail::put_le(buff, cp.uoffset, 8);
+            detail::put_le(buff + 8, cp.coffset, 8);
+            buff[16] = static_cast< char >(cp.bits);
+            detail::put_le(buff + 17, cp.window.size(), 4);
+            detail::put_le(buff + 21, sz, 8);
+            os.write(buff, 29);
+            os.write(z.data(), sz);
+        }
+    }
+
+    void load(std::istream & is)
+    {
+        char buff[29];
+        if (not is.read(buff, 8) or not std::equal(magic(), magic() + 8, buff) or not is.read(buff, 8))
+        {
+            throw Exception("zstr: invalid gzip index");
+        }
+        std::uint64_t n = detail::get_le(buff, 8);
+        checkpoint_v.clear();
+        for (std::uint64_t i = 0; i < n; ++i)
+        {
+            if (not is.read(buff, 29)) throw Exception("zstr: invalid gzip index");
+            checkpoint cp;
+            cp.uoffset = detail::get_le(buff, 8);
+            cp.coffset = detail::get_le(buff + 8, 8);
+            cp.bits = buff[16];
+            cp.window.resize(detail::get_le(buff + 17, 4));
+            std::string z(detail::get_le(buff + 21, 8), '\0');
+            uLongf sz = cp.window.size();
+            if (cp.window.size() > window_size or not is.read(&z[0], z.size())
+                or uncompress(reinterpret_cast< Bytef * >(&cp.window[0]), &sz,
+                              reinterpret_cast< const Bytef * >(z.data()), z.size()) != Z_OK
+                or sz != cp.window.size())
+            {
+                throw Exception("zstr: invalid gzip index");
+            }
+            add(std::move(cp));
+        }
+    }
+
+    static const std::size_t window_size = (std::size_t)1 << 15;
+
+private:
+    std::vector< checkpoint > checkpoint_v;
+
+    static const char * magic() { return "ZSTRGZI1"; }
+}; // class gzip_index
+
+namespace detail
+{
+
+/// Whole-buffer raw deflate codec, for blocks that are compressed and
+/// decompressed in one call, such as BGZF blocks. The backend is selected at
+/// compile time: libdeflate with ZSTR_WITH_LIBDEFLATE, or else zlib.
+class block_codec
+{
+public:
+    explicit block_codec(int _level = Z_DEFAULT_COMPRESSION)
+        : level(_level),
+#ifdef ZSTR_WITH_LIBDEFLATE
+          comp_p(nullptr),
+          decomp_p(nullptr)
+#else
+          zstrm_in_p(nullptr),
+          zstrm_out_p(nullptr)
+#endif
+    {}
+
+    block_codec(const block_codec &) = delete;
+    block_codec & operator = (const block_codec &) = delete;
+
+    ~block_codec()
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        if (comp_p) libdeflate_free_compressor(comp_p);
+        if (decomp_p) libdeflate_free_decompressor(decomp_p);
+#else
+        delete zstrm_in_p;
+        delete zstrm_out_p;
+#endif
+    }
+
+    /// Decompress a complete raw deflate stream to out; return the
+    /// uncompressed size. Throw if the data is invalid or does not fit.
+    std::size_t decompress(const char * in, std::size_t in_size, char * out, std::size_t out_size)
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        if (not decomp_p)
+        {
+            decomp_p = libdeflate_alloc_decompressor();
+            if (not decomp_p) throw Exception("libdeflate: cannot allocate decompressor");
+        }
+        std::size_t sz;
+        if (libdeflate_deflate_decompress(decomp_p, in, in_size, out, out_size, &sz) != LIBDEFLATE_SUCCESS)
+        {
+            throw Exception("libdeflate: invalid deflate data");
+        }
+        return sz;
+#else
+        if (not zstrm_in_p) zstrm_in_p = new z_stream_wrapper(true, Z_DEFAULT_COMPRESSION, -15);
+        int ret = inflateReset(zstrm_in_p);
+        if (ret != Z_OK) throw Exception(zstrm_in_p, ret);
+        zstrm_in_p->next_in = reinterpret_cast< decltype(zstrm_in_p->next_in) >(const_cast< char * >(in));
+        zstrm_in_p->avail_in = in_size;
+        // zlib rejects a null output pointer, even with no room for output
+        char dummy;
+        zstrm_in_p->next_out = reinterpret_cast< decltype(zstrm_in_p->next_out) >(out? out : &dummy);
+        zstrm_in_p->avail_out = out_size;
+        ret = inflate(zstrm_in_p, Z_FINISH);
+        if (ret != Z_STREAM_END) throw Exception(zstrm_in_p, ret);
+        return out_size - zstrm_in_p->avail_out;
+#endif
+    }
+
+    /// Upper bound on the compressed size of in_size bytes.
+    std::size_t bound(std::size_t in_size)
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        return libdeflate_deflate_compress_bound(compressor(), in_size);
+#else
+        return deflateBound(compressor(), in_size);
+#endif
+    }
+
+    /// Compress in to a complete raw deflate stream; return the compressed
+    /// size. out_size should be at least bound(in_size).
+    std::size_t compress(const char * in, std::size_t in_size, char * out, std::size_t out_size)
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        std::size_t sz = libdeflate_deflate_compress(compressor(), in, in_size, out, out_size);
+        if (sz == 0) throw Exception("libdeflate: output buffer too small");
+        return sz;
+#else
+        z_stream_wrapper * zstrm_p = compressor();
+        int ret = deflateReset(zstrm_p);
+        if (ret != Z_OK) throw Exception(zstrm_p, ret);
+        zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(const_cast< char * >(in));
+        zstrm_p->avail_in = in_size;
+        zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out);
+        zstrm_p->avail_out = out_size;
+        ret = deflate(zstrm_p, Z_FINISH);
+        if (ret != Z_STREAM_END) throw Exception("zlib: deflate: output buffer too small");
+        return out_size - zstrm_p->avail_out;
+#endif
+    }
+
+    /// CRC-32, as used by gzip.
+    static std::uint32_t crc(std::uint32_t _crc, const char * p, std::size_t sz)
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        return libdeflate_crc32(_crc, p, sz);
+#else
+        return crc32(_crc, reinterpret_cast< const Bytef * >(p), sz);
+#endif
+    }
+
+    static const char * backend()
+    {
+#ifdef ZSTR_WITH_LIBDEFLATE
+        return "libdeflate";
+#else
+        return "zlib";
+#endif
+    }
+
+private:
+    int level;
+#ifdef ZSTR_WITH_LIBDEFLATE
+    libdeflate_compressor * compressor()
+    {
+        if (not comp_p)
+        {
+            // libdeflate levels go from 0 to 12, and its default is 6, as zlib's
+            comp_p = libdeflate_alloc_compressor(level != Z_DEFAULT_COMPRESSION? level : 6);
+            if (not comp_p) throw Exception("libdeflate: cannot allocate compressor");
+        }
+        return comp_p;
+    }
+
+    libdeflate_compressor * comp_p;
+    libdeflate_decompressor * decomp_p;
+#else
+    z_stream_wrapper * compressor()
+    {
+        if (not zstrm_out_p) zstrm_out_p = new z_stream_wrapper(false, level, -15);
+        return zstrm_out_p;
+    }
+
+    z_stream_wrapper * zstrm_in_p;
+    z_stream_wrapper * zstrm_out_p;
+#endif
+}; // class block_codec
+
+/// Fixed pool of worker threads, running jobs from a queue in FIFO order.
+/// A job gets the index of the thread running it. With 0 threads, jobs run
+/// in the calling thread.
+class worker_pool
+{
+public:
+    explicit worker_pool(unsigned num_threads)
+        : shutdown(false)
+    {
+        thread_v.reserve(num_threads);
+        for (unsigned i = 0; i < num_threads; ++i)
+        {
+            thread_v.emplace_back(&worker_pool::worker, this, i);
+        }
+    }
+
+    worker_pool(const worker_pool &) = delete;
+    worker_pool & operator = (const worker_pool &) = delete;
+
+    ~worker_pool() { clear(); }
+
+    void add_job(std::function< void(unsigned) > job)
+    {
+        if (thread_v.empty())
+        {
+            job(0);
+            return;
+        }
+        std::unique_lock< std::mutex > l(mtx);
+        job_q.push(std::move(job));
+        cv.notify_one();
+    }
+
+    // Run the queued jobs, then join the threads.
+    void clear()
+    {
+        {
+            std::unique_lock< std::mutex > l(mtx);
+            shutdown = true;
+            cv.notify_all();
+        }
+        for (auto & t : thread_v) t.join();
+        thread_v.clear();
+    }
+
+private:
+    void worker(unsigned i)
+    {
+        while (true)
+        {
+            std::function< void(unsigned) > job;
+            {
+                std::unique_lock< std::mutex > l(mtx);
+                while (not shutdown and job_q.empty()) cv.wait(l);
+                if (job_q.empty()) return;
+                job = std::move(job_q.front());
+                job_q.pop();
+            }
+            job(i);
+        }
+    }
+
+    std::vector< std::thread > thread_v;
+    std::queue< std::function< void(unsigned) > > job_q;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool shutdown;
+}; // class worker_pool
+
+/// Block compressor, optionally parallel.
+///
+/// The uncompressed data is cut into blocks of at most buff_size bytes, and
+/// each block is compressed with raw deflate by a worker thread (or, with 0
+/// threads, by the calling thread). The calling thread writes the blocks back
+/// to the sink in order. Two output formats are supported:
+///
+/// - gzip (pigz-style): each block uses the last 32KB of the data preceding it
+///   as preset dictionary, and it is terminated with a sync flush, so that the
+///   compressed blocks can simply be concatenated inside a single gzip member,
+///   whose CRC is combined across blocks.
+///
+/// - BGZF: each block is an independent gzip member carrying the BC extra
+///   field, as expected by samtools/htslib. The empty EOF marker block is
+///   written by close().
+///
+/// The caller fills the buffer returned by buffer(), then hands it over with
+/// submit(); in gzip mode, a call to submit() with last == true ends the
+/// current gzip member.
+class block_deflater
+{
+public:
+    block_deflater(std::streambuf * _sbuf_p, std::size_t _buff_size, int _level, unsigned _threads,
+                   bool _bgzf = false)
+        : sbuf_p(_sbuf_p),
+          buff_size(_buff_size),
+          level(_level),
+          bgzf(_bgzf),
+          max_pending(2 * _threads),
+          zstrm_v(std::max(_threads, 1u), nullptr),
+          codec_v(std::max(_threads, 1u), nullptr),
+          crt_blk_p(new block(buff_size)),
+          member_crc(crc32(0L, Z_NULL, 0)),
+          member_size(0),
+          member_open(false),
+          pool(_threads)
+    {
+        assert(not bgzf or buff_size <= bgzf_max_block_size);
+    }
+
+    block_deflater(const block_deflater &) = delete;
+    block_deflater & operator = (const block_deflater &) = delete;
+
+    ~block_deflater()
+    {
+        // wait for any outstanding jobs before releasing their blocks
+        pool.clear();
+        for (auto b_p : pending_blk_q) delete b_p;
+        for (auto b_p : free_blk_v) delete b_p;
+        delete crt_blk_p;
+        for (auto zstrm_p : zstrm_v) delete zstrm_p;
+        for (auto codec_p : codec_v) delete codec_p;
+    }
+
+    char * buffer() { return crt_blk_p->in_buff; }
+
+    // Queue the current buffer for compression, and prepare a fresh one.
+    // Returns 0 on success, -1 if there was an error in the sink stream.
+    int submit(std::size_t sz, bool last)
+    {
+        assert(sz <= buff_size);
+        // empty BGZF blocks are reserved for the EOF marker
+        if (bgzf and sz == 0) return 0;
+        block * b_p = crt_blk_p;
+        b_p->in_size = sz;
+        b_p->dict = dict;
+        b_p->last = last;
+        b_p->done = false;
+        // remember the last 32KB of the member, to be used as dictionary by the next block
+        if (last or bgzf)
+        {
+            dict.clear();
+        }
+        else if (sz >= window_size)
+        {
+            dict.assign(b_p->in_buff + (sz - window_size), window_size);
+        }
+        else
+        {
+            dict.append(b_p->in_buff, sz);
+            if (dict.size() > window_size) dict.erase(0, dict.size() - window_size);
+        }
+        pending_blk_q.push_back(b_p);
+        pool.add_job([this, b_p] (unsigned tid) { compress_block(b_p, tid); });
+        // bound the number of blocks in flight
+        int res = 0;
+        while (pending_blk_q.size() > max_pending and res == 0)
+        {
+            res = write_block();
+        }
+        if (free_blk_v.empty())
+        {
+            crt_blk_p = new block(buff_size);
+        }
+        else
+        {
+            crt_blk_p = free_blk_v.back();
+            free_blk_v.pop_back();
+        }
+        return res;
+    }
+
+    // Write out all blocks queued so far.
+    int flush()
+    {
+        while (not pending_blk_q.empty())
+        {
+            if (write_block() != 0) return -1;
+        }
+        return 0;
+    }
+
+    // Write out all blocks, followed by the BGZF EOF marker, if any.
+    int close()
+    {
+        if (flush() != 0) return -1;
+        if (bgzf)
+        {
+            static const char eof_block[28] = {
+                '\x1F', '\x8B', 8, 4, 0, 0, 0, 0, 0, '\xFF', 6, 0, 'B', 'C', 2, 0,
+                0x1B, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+            if (sbuf_p->sputn(eof_block, 28) != 28) return -1;
+        }
+        return 0;
+    }
+
+    /// Maximum uncompressed size of a BGZF block, as used by htslib.
+    static const std::size_t bgzf_max_block_size = 0xFF00;
+
+private:
+    struct block
+    {
+        block(std::size_t _buff_size) : in_buff(new char [_buff_size]) {}
+        ~block() { delete [] in_buff; }
+        char * in_buff;
+        std::size_t in_size;
+        std::string dict;
+        std::vector< char > out_buff;
+        std::size_t out_size;
+        uLong crc;
+        bool last;
+        bool done;
+        std::string err;
+    }; // struct block
+
+    // Run by a worker thread.
+    void compress_block(block * b_p, unsigned tid)
+    {
+        try
+        {
+            if (bgzf)
+            {
+                // self-contained block: leave room for the member header and trailer
+                if (not codec_v[tid]) codec_v[tid] = new block_codec(level);
+                block_codec * codec_p = codec_v[tid];
+                std::size_t bound = 18 + codec_p->bound(b_p->in_size) + 8;
+                if (b_p->out_buff.size() < bound) b_p->out_buff.resize(bound);
+                b_p->out_size = 18 + codec_p->compress(b_p->in_buff, b_p->in_size,
+                                                       b_p->out_buff.data() + 18, b_p->out_buff.size() - 26) + 8;
+                b_p->crc = block_codec::crc(0, b_p->in_buff, b_p->in_size);
+                if (b_p->out_size > 0x10000) throw Exception("zstr: BGZF block too large");
+                // gzip header with the BC extra field holding the total block size - 1
+                static const char header[16] = {
+                    '\x1F', '\x8B', 8, 4, 0, 0, 0, 0, 0, '\xFF', 6, 0, 'B', 'C', 2, 0 };
+                char * p = b_p->out_buff.data();
+                std::copy(header, header + 16, p);
+                put_le(p + 16, b_p->out_size - 1, 2);
+                put_le(p + b_p->out_size - 8, b_p->crc, 4);
+                put_le(p + b_p->out_size - 4, b_p->in_size, 4);
+            }
+            else
+            {
+                if (not zstrm_v[tid]) zstrm_v[tid] = new z_stream_wrapper(false, level, -15);
+                z_stream_wrapper * zstrm_p = zstrm_v[tid];
+                int ret = deflateReset(zstrm_p);
+                if (ret == Z_OK and not b_p->dict.empty())
+                {
+                    ret = deflateSetDictionary(zstrm_p, reinterpret_cast< const Bytef * >(b_p->dict.data()), b_p->dict.size());
+                }
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+                // a sync flush adds at most a few bytes beyond deflateBound()
+                std::size_t bound = deflateBound(zstrm_p, b_p->in_size) + 16;
+                if (b_p->out_buff.size() < bound) b_p->out_buff.resize(bound);
+                zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(b_p->in_buff);
+                zstrm_p->avail_in = b_p->in_size;
+                zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(b_p->out_buff.data());
+                zstrm_p->avail_out = b_p->out_buff.size();
+                ret = deflate(zstrm_p, b_p->last? Z_FINISH : Z_SYNC_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END) throw Exception(zstrm_p, ret);
+                if (zstrm_p->avail_in > 0 or zstrm_p->avail_out == 0)
+                {
+                    throw Exception("zlib: deflate: output buffer too small");
+                }
+                b_p->out_size = b_p->out_buff.size() - zstrm_p->avail_out;
+                b_p->crc = block_codec::crc(0, b_p->in_buff, b_p->in_size);
+            }
+        }
+        catch (std::exception & e)
+        {
+            b_p->err = e.what();
+        }
+        std::unique_lock< std::mutex > l(done_mtx);
+        b_p->done = true;
+        done_cv.notify_all();
+    }
+
+    // Wait for the oldest pending block, and write it to the sink.
+    int write_block()
+    {
+        block * b_p = pending_blk_q.front();
+        {
+            std::unique_lock< std::mutex > l(done_mtx);
+            while (not b_p->done) done_cv.wait(l);
+        }
+        pending_blk_q.pop_front();
+        free_blk_v.push_back(b_p);
+        if (not b_p->err.empty())
+        {
+            std::string err;
+            std::swap(err, b_p->err);
+            throw Exception(err);
+        }
+        if (bgzf)
+        {
+            // self-contained gzip member
+            if (sbuf_p->sputn(b_p->out_buff.data(), b_p->out_size) != static_cast< std::streamsize >(b_p->out_size))
+            {
+                return -1;
+            }
+            return 0;
+        }
+        if (not member_open)
+        {
+            // gzip header: magic, deflate method, no flags, no mtime, unknown xfl, Unix OS
+            static const char header[10] = { '\x1F', '\x8B', 8, 0, 0, 0, 0, 0, 0, 3 };
+            if (sbuf_p->sputn(header, 10) != 10) return -1;
+            member_open = true;
+        }
+        if (sbuf_p->sputn(b_p->out_buff.data(), b_p->out_size) != static_cast< std::streamsize >(b_p->out_size))
+        {
+            return -1;
+        }
+        member_crc = crc32_combine(member_crc, b_p->crc, b_p->in_size);
+        member_size += b_p->in_size;
+        if (b_p->last)
+        {
+            // gzip trailer: CRC32 and ISIZE, both little-endian
+            char trailer[8];
+            put_le(trailer, member_crc, 4);
+            put_le(trailer + 4, member_size, 4);
+            if (sbuf_p->sputn(trailer, 8) != 8) return -1;
+            member_crc = crc32(0L, Z_NULL, 0);
+            member_size = 0;
+            member_open = false;
+        }
+        return 0;
+    }
+
+    std::streambuf * sbuf_p;
+    std::size_t buff_size;
+    int level;
+    bool bgzf;
+    std::size_t max_pending;
+    std::vector< z_stream_wrapper * > zstrm_v;
+    std::vector< block_codec * > codec_v;
+    block * crt_blk_p;
+    std::deque< block * > pending_blk_q;
+    std::vector< block * > free_blk_v;
+    std::string dict;
+    std::mutex done_mtx;
+    std::condition_variable done_cv;
+    uLong member_crc;
+    uLong member_size;
+    bool member_open;
+    worker_pool pool;
+
+    static const std::size_t window_size = (std::size_t)1 << 15;
+}; // class block_deflater
+
+/// Parallel decompressor for multi-member gzip data (including BGZF).
+///
+/// The compressed input is read ahead of the consumer and cut into segments
+/// of roughly buff_size bytes, at positions that look like gzip member
+/// boundaries: exact ones when the data is BGZF, or else the next occurrence
+/// of the gzip magic bytes. Worker threads inflate the segments speculatively
+/// and independently. The consumer takes the results in order, through a
+/// bounded queue. A result is only used if its segment is known to start on a
+/// member boundary, i.e. the previous segment ended exactly at the end of a
+/// member; otherwise, the inflate state left open at the end of the previous
+/// segment is used to continue decompression sequentially. This way, members
+/// that do not fit in a segment (or false magic matches) only cost speed.
+///
+/// With a checkpoint index covering the input, segments are cut at the
+/// checkpoints instead, and each one is inflated independently, starting from
+/// the checkpoint window. This way, a single gzip member is also decompressed
+/// in parallel.
+class parallel_inflater
+{
+public:
+    parallel_inflater(std::streambuf * _sbuf_p, std::size_t _buff_size, unsigned _threads,
+                      const char * _data, std::size_t _data_size,
+                      const gzip_index * _idx_p = nullptr, std::uint64_t _in_offset = 0)
+        : sbuf_p(_sbuf_p),
+          idx_p(_idx_p),
+          buff_size(_buff_size),
+          max_pending(2 * _threads),
+          next_cp(0),
+          in_offset(_in_offset),
+          pending_in(_data, _data_size),
+          next_at_boundary(true),
+          input_end(false),
+          crt_seg_p(nullptr),
+          carry_zstrm_p(nullptr),
+          codec_v(_threads, nullptr),
+          pool(_threads)
+    {}
+
+    parallel_inflater(const parallel_inflater &) = delete;
+    parallel_inflater & operator = (const parallel_inflater &) = delete;
+
+    ~parallel_inflater()
+    {
+        // wait for any outstanding jobs before releasing their segments
+        pool.clear();
+        for (auto seg_p : seg_q) delete seg_p;
+        delete crt_seg_p;
+        delete carry_zstrm_p;
+        for (auto codec_p : codec_v) delete codec_p;
+    }
+
+    // Get the next chunk of uncompressed data, valid until the next call.
+    // Returns false at the end of the input.
+    bool next(char * & data, std::size_t & size)
+    {
+        while (true)
+        {
+            delete crt_seg_p;
+            crt_seg_p = nullptr;
+            fill_queue();
+            if (seg_q.empty())
+            {
+                // NOTE: As in the sequential mode, a truncated last member is not an error.
+                return false;
+            }
+            segment * seg_p = seg_q.front();
+            seg_q.pop_front();
+            crt_seg_p = seg_p;
+            {
+                std::unique_lock< std::mutex > l(done_mtx);
+                while (not seg_p->done) done_cv.wait(l);
+            }
+            if (carry_zstrm_p or not seg_p->inflated)
+            {
+                // the segment does not start on a member boundary: discard any
+                // speculative result, and continue the current member
+                delete seg_p->zstrm_p;
+                seg_p->zstrm_p = carry_zstrm_p? carry_zstrm_p : new z_stream_wrapper(true);
+                carry_zstrm_p = nullptr;
+                inflate_segment(seg_p);
+            }
+            if (not seg_p->err.empty()) throw Exception(seg_p->err);
+            if (seg_p->open)
+            {
+                std::swap(carry_zstrm_p, seg_p->zstrm_p);
+            }
+            if (seg_p->out_size > 0)
+            {
+                data = &seg_p->out_buff[0];
+                size = seg_p->out_size;
+                return true;
+            }
+        }
+    }
+
+private:
+    struct segment
+    {
+        segment() : zstrm_p(nullptr), cp_p(nullptr), out_size(0), out_limit(0),
+                    open(false), inflated(false), done(false) {}
+        ~segment() { delete zstrm_p; }
+        std::string in_buff;
+        z_stream_wrapper * zstrm_p;
+        const gzip_index::checkpoint * cp_p;
+        std::vector< char > out_buff;
+        std::size_t out_size;
+        std::size_t out_limit;
+        bool open;
+        bool inflated;
+        bool done;
+        std::string err;
+    }; // struct segment
+
+    // Inflate all input of a segment, using its z_stream.
+    static void inflate_segment(segment * seg_p)
+    {
+        seg_p->inflated = true;
+        seg_p->out_size = 0;
+        seg_p->open = false;
+        seg_p->err.clear();
+        z_stream_wrapper * zstrm_p = seg_p->zstrm_p;
+        zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(&seg_p->in_buff[0]);
+        zstrm_p->avail_in = seg_p->in_buff.size();
+        try
+        {
+            while (true)
+            {
+                if (seg_p->out_buff.size() - seg_p->out_size < seg_p->in_buff.size())
+                {
+                    seg_p->out_buff.resize(seg_p->out_size + 2 * seg_p->in_buff.size() + 4096);
+                }
+                zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(&seg_p->out_buff[seg_p->out_size]);
+                zstrm_p->avail_out = seg_p->out_buff.size() - seg_p->out_size;
+                int ret = inflate(zstrm_p, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throw Exception(zstrm_p, ret);
+                seg_p->out_size = seg_p->out_buff.size() - zstrm_p->avail_out;
+                if (ret == Z_STREAM_END)
+                {
+                    if (zstrm_p->avail_in == 0) break;
+                    // another member follows in the same segment
+                    ret = inflateReset(zstrm_p);
+                    if (ret != Z_OK) throw Exception(zstrm_p, ret);
+                }
+                else if (zstrm_p->avail_in == 0 and zstrm_p->avail_out > 0)
+                {
+                    // the segment ends inside a member
+                    seg_p->open = true;
+                    break;
+                }
+            }
+        }
+        catch (std::exception & e)
+        {
+            seg_p->err = e.what();
+        }
+    }
+
+    // Decompress a segment made of whole BGZF blocks in one call per block,
+    // using the block codec. Return false if the segment is not of that form.
+    static bool inflate_bgzf_segment(segment * seg_p, block_codec & codec)
+    {
+        const std::string & s = seg_p->in_buff;
+        std::size_t out_size = 0;
+        for (std::size_t pos = 0; pos < s.size(); )
+        {
+            if (pos + 18 > s.size() or not is_bgzf_header(&s[pos])) return false;
+            std::size_t bsize = get_le(&s[pos + 16], 2) + 1;
+            if (bsize < 26 or pos + bsize > s.size()) return false;
+            std::size_t isize = get_le(&s[pos + bsize - 4], 4);
+            if (isize > 0x10000) return false;
+            out_size += isize;
+            pos += bsize;
+        }
+        seg_p->inflated = true;
+        seg_p->open = false;
+        seg_p->out_buff.resize(out_size);
+        seg_p->out_size = out_size;
+        try
+        {
+            char * out = seg_p->out_buff.data();
+            for (std::size_t pos = 0; pos < s.size(); )
+            {
+                std::size_t bsize = get_le(&s[pos + 16], 2) + 1;
+                std::size_t isize = get_le(&s[pos + bsize - 4], 4);
+                if (codec.decompress(&s[pos + 18], bsize - 26, out, isize) != isize
+                    or block_codec::crc(0, out, isize) != get_le(&s[pos + bsize - 8], 4))
+                {
+                    throw Exception("zstr: BGZF block checksum mismatch");
+                }
+                out += isize;
+                pos += bsize;
+            }
+        }
+        catch (std::exception & e)
+        {
+            seg_p->err = e.what();
+        }
+        return true;
+    }
+
+    // Inflate a segment starting at a checkpoint, resuming raw deflate
+    // decompression with the checkpoint window. Unless the segment extends to
+    // the end of the input, it must produce exactly the data up to the next
+    // checkpoint, given by out_limit.
+    static void inflate_indexed_segment(segment * seg_p)
+    {
+        seg_p->inflated = true;
+        try
+        {
+            const gzip_index::checkpoint & cp = *seg_p->cp_p;
+            std::string & s = seg_p->in_buff;
+            z_stream_wrapper * zstrm_p = new z_stream_wrapper(true, Z_DEFAULT_COMPRESSION, -15);
+            seg_p->zstrm_p = zstrm_p;
+            std::size_t pos = 0;
+            if (cp.bits)
+            {
+                int ret = inflatePrime(zstrm_p, cp.bits, static_cast< unsigned char >(s[0]) >> (8 - cp.bits));
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+                pos = 1;
+            }
+            if (not cp.window.empty())
+            {
+                int ret = inflateSetDictionary(zstrm_p, reinterpret_cast< const Bytef * >(cp.window.data()),
+                                               cp.window.size());
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+            }
+            zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(&s[pos]);
+            zstrm_p->avail_in = s.size() - pos;
+            std::size_t limit = seg_p->out_limit;
+            bool raw = true;
+            while (limit == 0 or seg_p->out_size < limit)
+            {
+                if (limit > 0)
+                {
+                    seg_p->out_buff.resize(limit);
+                }
+                else if (seg_p->out_buff.size() - seg_p->out_size < s.size())
+                {
+                    seg_p->out_buff.resize(seg_p->out_size + 2 * s.size() + 4096);
+                }
+                zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(&seg_p->out_buff[seg_p->out_size]);
+                zstrm_p->avail_out = seg_p->out_buff.size() - seg_p->out_size;
+                int ret = inflate(zstrm_p, Z_NO_FLUSH);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throw Exception(zstrm_p, ret);
+                seg_p->out_size = seg_p->out_buff.size() - zstrm_p->avail_out;
+                if (ret == Z_STREAM_END)
+                {
+                    if (raw)
+                    {
+                        // skip the trailer of the member resumed in raw mode,
+                        // and continue with gzip headers
+                        if (zstrm_p->avail_in < 8) break;
+                        zstrm_p->next_in += 8;
+                        zstrm_p->avail_in -= 8;
+                        raw = false;
+                        ret = inflateReset2(zstrm_p, 15 + 32);
+                    }
+                    else
+                    {
+                        ret = inflateReset(zstrm_p);
+                    }
+                    if (ret != Z_OK) throw Exception(zstrm_p, ret);
+                    if (zstrm_p->avail_in == 0) break;
+                }
+                else if (zstrm_p->avail_in == 0 and zstrm_p->avail_out > 0)
+                {
+                    // end of the input
+                    break;
+                }
+            }
+            if (limit > 0 and seg_p->out_size != limit) throw Exception("zstr: gzip index does not match the input");
+        }
+        catch (std::exception & e)
+        {
+            seg_p->err = e.what();
+        }
+    }
+
+    // Run by a worker thread.
+    void speculate_segment(segment * seg_p, unsigned tid)
+    {
+        if (not codec_v[tid]) codec_v[tid] = new block_codec();
+        if (seg_p->cp_p)
+        {
+            inflate_indexed_segment(seg_p);
+        }
+        else if (not inflate_bgzf_segment(seg_p, *codec_v[tid]))
+        {
+            seg_p->zstrm_p = new z_stream_wrapper(true);
+            inflate_segment(seg_p);
+        }
+        std::unique_lock< std::mutex > l(done_mtx);
+        seg_p->done = true;
+        done_cv.notify_all();
+    }
+
+    // Read input and queue segments, up to the maximum number in flight.
+    void fill_queue()
+    {
+        if (idx_p)
+        {
+            fill_indexed_queue();
+            return;
+        }
+        while (seg_q.size() < std::max< std::size_t >(max_pending, 1))
+        {
+            std::size_t cut = find_cut();
+            bool forced = false;
+            while (cut == 0)
+            {
+                if (input_end)
+                {
+                    cut = pending_in.size();
+                    break;
+                }
+                if (pending_in.size() >= 4 * buff_size)
+                {
+                    // no boundary in sight: cut anyway, and leave the rest to the consumer
+                    cut = pending_in.size();
+                    forced = true;
+                    break;
+                }
+                read_input();
+                cut = find_cut();
+            }
+            if (cut == 0) break;
+            segment * seg_p = new segment();
+            seg_p->in_buff.assign(pending_in, 0, cut);
+            pending_in.erase(0, cut);
+            in_offset += cut;
+            seg_q.push_back(seg_p);
+            if (next_at_boundary)
+            {
+                pool.add_job([this, seg_p] (unsigned tid) { speculate_segment(seg_p, tid); });
+            }
+            else
+            {
+                seg_p->done = true;
+            }
+            next_at_boundary = not forced;
+        }
+    }
+
+    // Queue segments from one checkpoint to the next, up to the maximum number
+    // in flight. The last segment extends to the end of the input.
+    void fill_indexed_queue()
+    {
+        const std::vector< gzip_index::checkpoint > & cp_v = idx_p->checkpoints();
+        while (seg_q.size() < std::max< std::size_t >(max_pending, 1) and next_cp < cp_v.size())
+        {
+            const gzip_index::checkpoint & cp = cp_v[next_cp];
+            std::uint64_t start = cp_start(cp);
+            // skip checkpoints that do not start at a later byte
+            std::size_t end_cp = next_cp + 1;
+            while (end_cp < cp_v.size() and cp_start(cp_v[end_cp]) <= start) ++end_cp;
+            // the segment needs the input up to the next checkpoint, and a few bytes more
+            std::uint64_t end = end_cp < cp_v.size()? cp_start(cp_v[end_cp]) + 64 : UINT64_MAX;
+            while (not input_end and in_offset + pending_in.size() < end) read_input();
+            if (in_offset > start or in_offset + pending_in.size() <= start)
+            {
+                throw Exception("zstr: gzip index does not match the input");
+            }
+            pending_in.erase(0, start - in_offset);
+            in_offset = start;
+            segment * seg_p = new segment();
+            seg_p->cp_p = &cp;
+            seg_p->out_limit = end_cp < cp_v.size()? cp_v[end_cp].uoffset - cp.uoffset : 0;
+            seg_p->in_buff.assign(pending_in, 0, end - start);
+            seg_q.push_back(seg_p);
+            pool.add_job([this, seg_p] (unsigned tid) { speculate_segment(seg_p, tid); });
+            next_cp = end_cp;
+        }
+    }
+
+    // Append up to buff_size bytes of input to pending_in.
+    void read_input()
+    {
+        std::size_t sz = pending_in.size();
+        pending_in.resize(sz + buff_size);
+        std::streamsize cnt = sbuf_p->sgetn(&pending_in[sz], buff_size);
+        pending_in.resize(sz + cnt);
+        if (cnt == 0) input_end = true;
+    }
+
+    // Offset of the first compressed byte needed to resume at a checkpoint.
+    static std::uint64_t cp_start(const gzip_index::checkpoint & cp)
+    {
+        return cp.coffset - (cp.bits? 1 : 0);
+    }
+
+    // Find where to end the next segment: the first (likely) member boundary
+    // past buff_size bytes. Returns 0 if more input is needed.
+    std::size_t find_cut() const
+    {
+        const std::string & s = pending_in;
+        if (s.size() < buff_size) return 0;
+        // exact BGZF member boundaries
+        std::size_t pos = 0;
+        while (pos + 18 <= s.size() and is_bgzf_header(&s[pos]))
+        {
+            pos += get_le(&s[pos + 16], 2) + 1;
+            if (pos >= buff_size) return pos <= s.size()? pos : 0;
+        }
+        // candidate gzip headers: magic, deflate method, no reserved flags
+        for (pos = buff_size; pos + 4 <= s.size(); ++pos)
+        {
+            const char * p = static_cast< const char * >(std::memchr(&s[pos], 0x1F, s.size() - 3 - pos));
+            if (not p) break;
+            pos = p - &s[0];
+            if (p[1] == '\x8B' and p[2] == 8 and (p[3] & 0xE0) == 0) return pos;
+        }
+        return 0;
+    }
+
+    static bool is_bgzf_header(const char * p)
+    {
+        return p[0] == '\x1F' and p[1] == '\x8B' and p[2] == 8 and p[3] == 4
+            and p[10] == 6 and p[11] == 0 and p[12] == 'B' and p[13] == 'C' and p[14] == 2 and p[15] == 0;
+    }
+
+    std::streambuf * sbuf_p;
+    const gzip_index * idx_p;
+    std::size_t buff_size;
+    std::size_t max_pending;
+    std::size_t next_cp;
+    std::uint64_t in_offset;
+    std::string pending_in;
+    bool next_at_boundary;
+    bool input_end;
+    std::deque< segment * > seg_q;
+    segment * crt_seg_p;
+    z_stream_wrapper * carry_zstrm_p;
+    std::vector< block_codec * > codec_v;
+    std::mutex done_mtx;
+    std::condition_variable done_cv;
+    worker_pool pool;
+}; // class parallel_inflater
+
+} // namespace detail
+
+/// Name of the codec used for single-call block (de)compression, as in BGZF:
+/// "libdeflate" with ZSTR_WITH_LIBDEFLATE, "zlib" otherwise.
+inline const char * block_backend()
+{
+    return detail::block_codec::backend();
+}
+
+/// Pool of I/O buffers shared by istreambuf and ostreambuf objects.
+///
+/// Released buffers are kept, up to max_buffers() of them, and handed out
+/// again for requests of the same size, so that streams opened and closed in
+/// a tight loop reuse their memory. The shared pool keeps no buffers by
+/// default; enable it with buffer_pool::shared().set_max_buffers(n).
+class buffer_pool
+{
+public:
+    explicit buffer_pool(std::size_t _max_buffers = 0) : max_buf(_max_buffers) {}
+
+    buffer_pool(const buffer_pool &) = delete;
+    buffer_pool & operator = (const buffer_pool &) = delete;
+
+    ~buffer_pool() { set_max_buffers(0); }
+
+    /// Get a buffer of the given size, reused if possible.
+    char * get(std::size_t size)
+    {
+        {
+            std::lock_guard< std::mutex > lk(mtx);
+            for (auto it = free_v.begin(); it != free_v.end(); ++it)
+            {
+                if (it->second != size) continue;
+                char * p = it->first;
+                free_v.erase(it);
+                return p;
+            }
+        }
+        return new char [size];
+    }
+
+    /// Release a buffer obtained with get(). Null pointers are ignored.
+    void put(char * p, std::size_t size)
+    {
+        if (not p) return;
+        {
+            std::lock_guard< std::mutex > lk(mtx);
+            if (free_v.size() < max_buf)
+            {
+                free_v.emplace_back(p, size);
+                return;
+            }
+        }
+        delete [] p;
+    }
+
+    /// Set the maximum number of released buffers kept; extra ones are freed.
+    void set_max_buffers(std::size_t _max_buffers)
+    {
+        std::lock_guard< std::mutex > lk(mtx);
+        max_buf = _max_buffers;
+        while (free_v.size() > max_buf)
+        {
+            delete [] free_v.back().first;
+            free_v.pop_back();
+        }
+    }
+
+    std::size_t max_buffers()
+    {
+        std::lock_guard< std::mutex > lk(mtx);
+        return max_buf;
+    }
+
+    /// Number of released buffers currently kept.
+    std::size_t size()
+    {
+        std::lock_guard< std::mutex > lk(mtx);
+        return free_v.size();
+    }
+
+    /// The pool used by istreambuf and ostreambuf.
+    static buffer_pool & shared()
+    {
+        static buffer_pool pool;
+        return pool;
+    }
+
+private:
+    std::mutex mtx;
+    std::vector< std::pair< char *, std::size_t > > free_v;
+    std::size_t max_buf;
+}; // class buffer_pool
+
+/// Interface of the source streambufs whose data can be taken in place,
+/// without copies. An istreambuf reading from such a source inflates the
+/// data where it is, and serves uncompressed data straight from it.
+class in_place_source
+{
+public:
+    virtual ~in_place_source() {}
+
+    /// Take up to max_size bytes from the current position, without copying.
+    /// The data stays valid until the next call. Returns 0 at the end of the input.
+    virtual std::size_t take(char * & p, std::size_t max_size) = 0;
+}; // class in_place_source
+
+/// Read-ahead adapter for an input streambuf.
+///
+/// A background thread reads the source in chunks of buff_size bytes into a
+/// ring of depth buffers, so that I/O latency overlaps with the work done by
+/// the consumer on the current buffer. While the adapter exists, the source
+/// must not be accessed by anyone else. Exceptions thrown by the source are
+/// rethrown to the consumer.
+///
+/// NOTE: The destructor waits for the read in progress, if any, to return.
+class readahead_streambuf
+    : public std::streambuf,
+      public in_place_source
+{
+public:
+    readahead_streambuf(std::streambuf * _sbuf_p, std::size_t _buff_size = (std::size_t)1 << 20,
+                        unsigned _depth = 2)
+        : sbuf_p(_sbuf_p),
+          buff_size(_buff_size),
+          slot_v(std::max(_depth, 2u)),
+          read_idx(0),
+          holding(false),
+          stop(false)
+    {
+        assert(sbuf_p);
+        for (auto & slot : slot_v)
+        {
+            slot.buff = new char [buff_size];
+        }
+        setg(nullptr, nullptr, nullptr);
+        reader = std::thread(&readahead_streambuf::read_loop, this);
+    }
+
+    readahead_streambuf(const readahead_streambuf &) = delete;
+    readahead_streambuf & operator = (const readahead_streambuf &) = delete;
+
+    virtual ~readahead_streambuf()
+    {
+        {
+            std::unique_lock< std::mutex > l(mtx);
+            stop = true;
+            cv.notify_all();
+        }
+        reader.join();
+        for (auto & slot : slot_v)
+        {
+            delete [] slot.buff;
+        }
+    }
+
+    virtual std::streambuf::int_type underflow()
+    {
+        if (this->gptr() == this->egptr())
+        {
+            std::unique_lock< std::mutex > l(mtx);
+            if (holding)
+            {
+                // hand the consumed buffer back to the reader
+                slot_v[read_idx].full = false;
+                read_idx = (read_idx + 1) % slot_v.size();
+                holding = false;
+                cv.notify_all();
+            }
+            slot & s = slot_v[read_idx];
+            while (not s.full) cv.wait(l);
+            if (s.exc_p) std::rethrow_exception(s.exc_p);
+            if (s.size > 0)
+            {
+                this->setg(s.buff, s.buff, s.buff + s.size);
+                holding = true;
+            }
+        }
+        return this->gptr() == this->egptr()
+            ? traits_type::eof()
+            : traits_type::to_int_type(*this->gptr());
+    }
+
+    virtual std::size_t take(char * & p, std::size_t max_size)
+    {
+        underflow();
+        p = this->gptr();
+        std::size_t sz = std::min< std::size_t >(this->egptr() - this->gptr(), max_size);
+        this->setg(this->eback(), this->gptr() + sz, this->egptr());
+        return sz;
+    }
+
+private:
+    struct slot
+    {
+        slot() : buff(nullptr), size(0), full(false) {}
+        char * buff;
+        std::size_t size;
+        bool full;
+        std::exception_ptr exc_p;
+    }; // struct slot
+
+    // Run by the reader thread.
+    void read_loop()
+    {
+        for (std::size_t write_idx = 0; ; write_idx = (write_idx + 1) % slot_v.size())
+        {
+            slot & s = slot_v[write_idx];
+            {
+                std::unique_lock< std::mutex > l(mtx);
+                while (s.full and not stop) cv.wait(l);
+                if (stop) return;
+            }
+            // a slot is full at the end of the input, or after an exception
+            std::size_t sz = 0;
+            std::exception_ptr exc_p;
+            try
+            {
+                sz = sbuf_p->sgetn(s.buff, buff_size);
+            }
+            catch (...)
+            {
+                exc_p = std::current_exception();
+            }
+            std::unique_lock< std::mutex > l(mtx);
+            s.size = sz;
+            s.exc_p = exc_p;
+            s.full = true;
+            cv.notify_all();
+            if (sz == 0 or exc_p) return;
+        }
+    }
+
+    std::streambuf * sbuf_p;
+    std::size_t buff_size;
+    std::vector< slot > slot_v;
+    std::size_t read_idx;
+    bool holding;
+    bool stop;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread reader;
+}; // class readahead_streambuf
+
+namespace detail
+{
+
+/// Write-behind counterpart of readahead_streambuf: a background thread
+/// runs a job on each buffer handed over with submit(), in order, while the
+/// caller fills the next buffer. At most depth buffers are in flight. The
+/// first error, i.e. a job returning non-zero or throwing, is reported by
+/// the next submit() or wait(), and later buffers are discarded.
+class write_behind
+{
+public:
+    typedef std::function< int(char *, std::size_t, bool) > job_type;
+
+    write_behind(job_type _job, std::size_t _buff_size, unsigned _depth = 2)
+        : job(_job),
+          buff_size(_buff_size),
+          max_buffers(std::max(_depth, 1u) + 1),
+          n_buffers(1),
+          busy(false),
+          status(0),
+          stop(false)
+    {
+        crt_buff = new char [buff_size];
+        worker = std::thread(&write_behind::run, this);
+    }
+
+    write_behind(const write_behind &) = delete;
+    write_behind & operator = (const write_behind &) = delete;
+
+    ~write_behind()
+    {
+        {
+            std::unique_lock< std::mutex > l(mtx);
+            stop = true;
+            cv.notify_all();
+        }
+        worker.join();
+        for (auto & it : item_q) delete [] it.buff;
+        for (auto p : free_v) delete [] p;
+        delete [] crt_buff;
+    }
+
+    char * buffer() const { return crt_buff; }
+
+    // Hand the first sz bytes of the current buffer over to the background
+    // thread, with the given job flag, and prepare a fresh buffer. Returns
+    // 0 on success, -1 after an error.
+    int submit(std::size_t sz, bool flag)
+    {
+        std::unique_lock< std::mutex > l(mtx);
+        item_q.push_back(item{ crt_buff, sz, flag });
+        crt_buff = nullptr;
+        cv.notify_all();
+        if (free_v.empty() and n_buffers < max_buffers)
+        {
+            ++n_buffers;
+            crt_buff = new char [buff_size];
+        }
+        else
+        {
+            while (free_v.empty()) cv.wait(l);
+            crt_buff = free_v.back();
+            free_v.pop_back();
+        }
+        return check();
+    }
+
+    // Wait for all buffers submitted so far. Returns 0 on success, -1 after an error.
+    int wait()
+    {
+        std::unique_lock< std::mutex > l(mtx);
+        while (not item_q.empty() or busy) cv.wait(l);
+        return check();
+    }
+
+    // Run f with the mutex held, to access state shared with the jobs.
+    template < typename Function >
+    void locked(Function f)
+    {
+        std::lock_guard< std::mutex > l(mtx);
+        f();
+    }
+
+private:
+    struct item
+    {
+        char * buff;
+        std::size_t size;
+        bool flag;
+    }; // struct item
+
+    // Called with the mutex held.
+    int check()
+    {
+        if (exc_p)
+        {
+            std::exception_ptr e = exc_p;
+            exc_p = nullptr;
+            std::rethrow_exception(e);
+        }
+        return status;
+    }
+
+    // Run by the background thread.
+    void run()
+    {
+        std::unique_lock< std::mutex > l(mtx);
+        while (true)
+        {
+            while (item_q.empty() and not stop) cv.wait(l);
+            if (item_q.empty()) return;
+            item it = item_q.front();
+            item_q.pop_front();
+            if (status == 0 and not exc_p)
+            {
+                busy = true;
+                l.unlock();
+                int res = 0;
+                std::exception_ptr e;
+                try
+                {
+                    res = job(it.buff, it.size, it.flag);
+                }
+                catch (...)
+                {
+                    e = std::current_exception();
+                }
+                l.lock();
+                busy = false;
+                if (res != 0 or e) status = -1;
+                exc_p = e;
+            }
+            free_v.push_back(it.buff);
+            cv.notify_all();
+        }
+    }
+
+    job_type job;
+    std::size_t buff_size;
+    std::size_t max_buffers;
+    std::size_t n_buffers;
+    char * crt_buff;
+    std::deque< item > item_q;
+    std::vector< char * > free_v;
+    bool busy;
+    int status;
+    std::exception_ptr exc_p;
+    bool stop;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread worker;
+}; // class write_behind
+
+} // namespace detail
+
+/// Input streambuf serving a memory-mapped file.
+///
+/// The whole file is mapped read-only and exposed as the get area, so reading
+/// it involves no system calls and no copies. When used as the source of an
+/// istreambuf, inflate() reads straight from the mapping, and uncompressed
+/// input is served from the mapping itself. With populate, the pages are read
+/// in advance (MAP_POPULATE, where available).
+///
+/// NOTE: Not available on Windows, where the constructor throws.
+class mmap_streambuf
+    : public std::streambuf,
+      public in_place_source
+{
+public:
+    explicit mmap_streambuf(const std::string & filename, bool populate = false)
+        : addr(nullptr),
+          size(0)
+    {
+#ifndef _WIN32
+        std::string msg_prefix = std::string("zstr: mmap('") + filename + "'): ";
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) throw Exception(msg_prefix + strict_fstream::strerror());
+        struct stat st;
+        if (::fstat(fd, &st) != 0 or not S_ISREG(st.st_mode))
+        {
+            ::close(fd);
+            throw Exception(msg_prefix + "not a regular file");
+        }
+        size = st.st_size;
+        if (size > 0)
+        {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            if (populate) flags |= MAP_POPULATE;
+#endif
+            void * p = ::mmap(nullptr, size, PROT_READ, flags, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                std::string msg = msg_prefix + strict_fstream::strerror();
+                ::close(fd);
+                throw Exception(msg);
+            }
+            addr = static_cast< char * >(p);
+            ::madvise(addr, size, MADV_SEQUENTIAL);
+        }
+        // the mapping outlives the descriptor
+        ::close(fd);
+        (void)populate;
+#else
+        (void)populate;
+        throw Exception(std::string("zstr: mmap('") + filename + "'): not supported");
+#endif
+        setg(addr, addr, addr + size);
+    }
+
+    mmap_streambuf(const mmap_streambuf &) = delete;
+    mmap_streambuf & operator = (const mmap_streambuf &) = delete;
+
+    virtual ~mmap_streambuf()
+    {
+#ifndef _WIN32
+        if (addr) ::munmap(addr, size);
+#endif
+    }
+
+    /// Take up to max_size bytes from the current position, without copying.
+    virtual std::size_t take(char * & p, std::size_t max_size)
+    {
+        p = this->gptr();
+        std::size_t sz = std::min< std::size_t >(this->egptr() - this->gptr(), max_size);
+        this->setg(this->eback(), this->gptr() + sz, this->egptr());
+        return sz;
+    }
+
+    virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir dir,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        off_type base = (dir == std::ios_base::beg? 0
+                         : dir == std::ios_base::cur? this->gptr() - this->eback()
+                         : static_cast< off_type >(size));
+        return seekpos(base + off, which);
+    }
+
+    virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type sp,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        off_type off = sp;
+        if (not (which & std::ios_base::in) or off < 0 or off > static_cast< off_type >(size))
+        {
+            return pos_type(off_type(-1));
+        }
+        this->setg(this->eback(), this->eback() + off, this->egptr());
+        return sp;
+    }
+
+private:
+    char * addr;
+    std::size_t size;
+}; // class mmap_streambuf
+
+namespace detail
+{
+
+/// Minimal io_uring submission and completion queues, driven through the
+/// raw system calls, as liburing does. Requests are identified by a tag.
+/// Without ZSTR_WITH_IO_URING, or if the kernel does not support io_uring,
+/// the constructor throws.
+class io_uring_queue
+{
+public:
+    explicit io_uring_queue(unsigned entries)
+        : ring_fd(-1),
+          sq_ptr(nullptr),
+          cq_ptr(nullptr),
+          sqe_ptr(nullptr),
+          sq_size(0),
+          cq_size(0),
+          sqe_size(0),
+          to_submit(0)
+    {
+#ifdef ZSTR_WITH_IO_URING
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        ring_fd = static_cast< int >(::syscall(__NR_io_uring_setup, entries, &p));
+        if (ring_fd < 0) throw Exception(std::string("zstr: io_uring_setup: ") + strict_fstream::strerror());
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = map(sq_size, IORING_OFF_SQ_RING);
+        cq_ptr = single_mmap? sq_ptr : map(cq_size, IORING_OFF_CQ_RING);
+        sqe_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqe_ptr = map(sqe_size, IORING_OFF_SQES);
+        char * sq = static_cast< char * >(sq_ptr);
+        sq_tail = reinterpret_cast< unsigned * >(sq + p.sq_off.tail);
+        sq_mask = *reinterpret_cast< unsigned * >(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast< unsigned * >(sq + p.sq_off.array);
+        char * cq = static_cast< char * >(cq_ptr);
+        cq_head = reinterpret_cast< unsigned * >(cq + p.cq_off.head);
+        cq_tail = reinterpret_cast< unsigned * >(cq + p.cq_off.tail);
+        cq_mask = *reinterpret_cast< unsigned * >(cq + p.cq_off.ring_mask);
+        cqe_ptr = cq + p.cq_off.cqes;
+#else
+        (void)entries;
+        throw Exception("zstr: io_uring support not compiled in (define ZSTR_WITH_IO_URING)");
+#endif
+    }
+
+    io_uring_queue(const io_uring_queue &) = delete;
+    io_uring_queue & operator = (const io_uring_queue &) = delete;
+
+    ~io_uring_queue() { release(); }
+
+    // Queue a read or a write of len bytes at file offset off.
+    void push(bool write, int fd, char * buff, unsigned len, std::uint64_t off, std::uint64_t tag)
+    {
+#ifdef ZSTR_WITH_IO_URING
+        // only this thread moves the tail
+        unsigned tail = *sq_tail;
+        unsigned idx = tail & sq_mask;
+        io_uring_sqe * sqe = static_cast< io_uring_sqe * >(sqe_ptr) + idx;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = write? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast< std::uint64_t >(buff);
+        sqe->len = len;
+        sqe->off = off;
+        sqe->user_data = tag;
+        sq_array[idx] = idx;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit;
+#else
+        (void)write; (void)fd; (void)buff; (void)len; (void)off; (void)tag;
+#endif
+    }
+
+    // Submit the queued requests, without waiting.
+    void submit()
+    {
+        if (to_submit > 0) enter(0);
+    }
+
+    // Submit the queued requests, and wait for the one with the given tag.
+    // Return its result: a byte count, or -errno.
+    int wait(std::uint64_t tag)
+    {
+        while (true)
+        {
+            reap();
+            auto it = done_m.find(tag);
+            if (it != done_m.end())
+            {
+                int res = it->second;
+                done_m.erase(it);
+                return res;
+            }
+            enter(1);
+        }
+    }
+
+    // Wait for the request with the given tag, ignoring its result, for use
+    // in destructors. Return false if the ring failed, in which case the
+    // kernel may still be using the request buffer.
+    bool drain(std::uint64_t tag) noexcept
+    {
+        try
+        {
+            wait(tag);
+            return true;
+        }
+        catch (...)
+        {
+            return false;
+        }
+    }
+
+private:
+#ifdef ZSTR_WITH_IO_URING
+    void * map(std::size_t size, off_t off)
+    {
+        void * p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, off);
+        if (p == MAP_FAILED)
+        {
+            std::string msg = std::string("zstr: io_uring mmap: ") + strict_fstream::strerror();
+            release();
+            throw Exception(msg);
+        }
+        return p;
+    }
+#endif
+
+    void release()
+    {
+#ifdef ZSTR_WITH_IO_URING
+        if (sqe_ptr) ::munmap(sqe_ptr, sqe_size);
+        if (cq_ptr and cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_size);
+        if (sq_ptr) ::munmap(sq_ptr, sq_size);
+        if (ring_fd >= 0) ::close(ring_fd);
+        sqe_ptr = cq_ptr = sq_ptr = nullptr;
+        ring_fd = -1;
+#endif
+    }
+
+    void enter(unsigned min_complete)
+    {
+#ifdef ZSTR_WITH_IO_URING
+        while (true)
+        {
+            long ret = ::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                                 min_complete > 0? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0)
+            {
+                to_submit -= ret;
+                return;
+            }
+            if (errno != EINTR and errno != EAGAIN and errno != EBUSY)
+            {
+                throw Exception(std::string("zstr: io_uring_enter: ") + strict_fstream::strerror());
+            }
+        }
+#else
+        (void)min_complete;
+#endif
+    }
+
+    // Move all available completions to done_m.
+    void reap()
+    {
+#ifdef ZSTR_WITH_IO_URING
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            const io_uring_cqe * cqe = static_cast< const io_uring_cqe * >(cqe_ptr) + (head & cq_mask);
+            done_m[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+#endif
+    }
+
+    int ring_fd;
+    void * sq_ptr;
+    void * cq_ptr;
+    void * sqe_ptr;
+    void * cqe_ptr;
+    std::size_t sq_size;
+    std::size_t cq_size;
+    std::size_t sqe_size;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned cq_mask;
+    unsigned to_submit;
+    std::map< std::uint64_t, int > done_m;
+}; // class io_uring_queue
+
+} // namespace detail
+
+/// File streambuf doing its I/O with io_uring (see ZSTR_WITH_IO_URING).
+///
+/// For input, reads of buff_size bytes at consecutive offsets are kept queued
+/// in a ring of depth buffers, so that the device works ahead of the
+/// consumer, e.g. an istreambuf using this as source. For output, each full
+/// buffer is submitted as a write at its file offset, and the caller goes on
+/// with the next free buffer; sync() waits for all writes, and reports
+/// errors. If io_uring is not compiled in, or not supported by the kernel,
+/// the same is done with blocking pread()/pwrite() calls; see
+/// uses_io_uring(). Read errors throw.
+///
+/// NOTE: Not available on Windows, where the constructor throws.
+class uring_streambuf
+    : public std::streambuf,
+      public in_place_source
+{
+public:
+    explicit uring_streambuf(const std::string & filename, std::ios_base::openmode mode = std::ios_base::in,
+                             std::size_t _buff_size = (std::size_t)1 << 20, unsigned _depth = 4)
+        : fd(-1),
+          ring_p(nullptr),
+          is_output((mode & std::ios_base::out) != 0),
+          buff_size(_buff_size),
+          slot_v(std::max(_depth, 1u)),
+          crt(0),
+          offset(0),
+          holding(false),
+          at_end(false),
+          failed(false)
+    {
+#ifndef _WIN32
+        std::string msg_prefix = std::string("zstr: open('") + filename + "'): ";
+        int flags = (not is_output? O_RDONLY
+                     : (mode & std::ios_base::app)? O_WRONLY | O_CREAT
+                     : O_WRONLY | O_CREAT | O_TRUNC);
+        fd = ::open(filename.c_str(), flags, 0666);
+        if (fd < 0) throw Exception(msg_prefix + strict_fstream::strerror());
+        if (mode & std::ios_base::app) offset = ::lseek(fd, 0, SEEK_END);
+        try
+        {
+            ring_p = new detail::io_uring_queue(slot_v.size());
+        }
+        catch (Exception &)
+        {
+            // no io_uring: use system calls instead
+        }
+#else
+        throw Exception(std::string("zstr: open('") + filename + "'): uring_streambuf not supported");
+#endif
+        for (auto & s : slot_v) s.buff = new char [buff_size];
+        if (is_output)
+        {
+            setp(slot_v[0].buff, slot_v[0].buff + buff_size);
+        }
+        else
+        {
+            setg(nullptr, nullptr, nullptr);
+            for (std::size_t i = 0; i < slot_v.size(); ++i) queue_read(i);
+        }
+    }
+
+    uring_streambuf(const uring_streambuf &) = delete;
+    uring_streambuf & operator = (const uring_streambuf &) = delete;
+
+    virtual ~uring_streambuf()
+    {
+        // NOTE: As with std::basic_filebuf, errors are ignored here; call
+        // pubsync() first to see them.
+        try
+        {
+            if (is_output) sync();
+        }
+        catch (...) {}
+        // the kernel may still use the buffers of unfinished requests
+        bool drained = true;
+        for (std::size_t i = 0; i < slot_v.size(); ++i)
+        {
+            if (slot_v[i].in_flight and not ring_p->drain(i)) drained = false;
+        }
+        delete ring_p;
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+#endif
+        // if the ring failed, leak the buffers rather than free memory the
+        // kernel may still write to
+        if (drained) for (auto & s : slot_v) delete [] s.buff;
+    }
+
+    bool uses_io_uring() const { return ring_p != nullptr; }
+
+    virtual std::size_t take(char * & p, std::size_t max_size)
+    {
+        underflow();
+        p = this->gptr();
+        std::size_t sz = std::min< std::size_t >(this->egptr() - this->gptr(), max_size);
+        this->setg(this->eback(), this->gptr() + sz, this->egptr());
+        return sz;
+    }
+
+    virtual std::streambuf::int_type underflow()
+    {
+        if (this->gptr() == this->egptr() and not is_output and not at_end)
+        {
+            if (holding)
+            {
+                // reuse the consumed buffer for the next read
+                queue_read(crt);
+                crt = (crt + 1) % slot_v.size();
+                holding = false;
+            }
+            std::size_t sz = complete_read(slot_v[crt]);
+            if (sz > 0)
+            {
+                this->setg(slot_v[crt].buff, slot_v[crt].buff, slot_v[crt].buff + sz);
+                holding = true;
+            }
+            else
+            {
+                at_end = true;
+            }
+        }
+        return this->gptr() == this->egptr()
+            ? traits_type::eof()
+            : traits_type::to_int_type(*this->gptr());
+    }
+
+    virtual std::streambuf::int_type overflow(std::streambuf::int_type c = traits_type::eof())
+    {
+        if (not is_output or failed or submit_write(crt, this->pptr() - this->pbase()) != 0)
+        {
+            fail();
+            return traits_type::eof();
+        }
+        // continue with the oldest buffer, once its write is done
+        crt = (crt + 1) % slot_v.size();
+        if (complete_write(slot_v[crt]) != 0)
+        {
+            fail();
+            return traits_type::eof();
+        }
+        this->setp(slot_v[crt].buff, slot_v[crt].buff + buff_size);
+        return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::eof() : this->sputc(c);
+    }
+
+    virtual int sync()
+    {
+        if (not is_output) return 0;
+        if (failed or submit_write(crt, this->pptr() - this->pbase()) != 0)
+        {
+            fail();
+            return -1;
+        }
+        for (auto & s : slot_v)
+        {
+            if (complete_write(s) != 0)
+            {
+                fail();
+                return -1;
+            }
+        }
+        this->setp(slot_v[crt].buff, slot_v[crt].buff + buff_size);
+        return 0;
+    }
+
+private:
+    struct slot
+    {
+        slot() : buff(nullptr), off(0), len(0), done(0), in_flight(false) {}
+        char * buff;
+        std::uint64_t off;
+        std::size_t len;
+        std::size_t done;
+        bool in_flight;
+    }; // struct slot
+
+    void fail()
+    {
+        failed = true;
+        this->setp(nullptr, nullptr);
+    }
+
+    // Assign the next file offset to slot i, and queue its read.
+    void queue_read(std::size_t i)
+    {
+        slot & s = slot_v[i];
+        s.off = offset;
+        s.len = buff_size;
+        s.done = 0;
+        offset += buff_size;
+        if (ring_p)
+        {
+            ring_p->push(false, fd, s.buff, s.len, s.off, i);
+            ring_p->submit();
+            s.in_flight = true;
+        }
+    }
+
+    // Finish the read of a slot, and return the number of bytes read:
+    // less than buff_size only at the end of the file.
+    std::size_t complete_read(slot & s)
+    {
+        std::size_t i = &s - &slot_v[0];
+        while (s.done < s.len)
+        {
+            long res = 0;
+            if (ring_p)
+            {
+                if (not s.in_flight) ring_p->push(false, fd, s.buff + s.done, s.len - s.done, s.off + s.done, i);
+                res = ring_p->wait(i);
+                s.in_flight = false;
+            }
+            else
+            {
+#ifndef _WIN32
+                res = ::pread(fd, s.buff + s.done, s.len - s.done, s.off + s.done);
+                if (res < 0) res = -errno;
+#endif
+            }
+            if (res == -EINTR or res == -EAGAIN) continue;
+            if (res < 0) throw Exception(std::string("zstr: read: ") + std::strerror(-res));
+            if (res == 0) break;
+            s.done += res;
+        }
+        return s.done;
+    }
+
+    // Submit the write of the first sz bytes of slot i, at the next file
+    // offset. Without io_uring, the write is done here.
+    int submit_write(std::size_t i, std::size_t sz)
+    {
+        slot & s = slot_v[i];
+        s.off = offset;
+        s.len = sz;
+        s.done = 0;
+        offset += sz;
+        if (sz == 0) return 0;
+        if (ring_p)
+        {
+            ring_p->push(true, fd, s.buff, s.len, s.off, i);
+            ring_p->submit();
+            s.in_flight = true;
+            return 0;
+        }
+        return complete_write(s);
+    }
+
+    // Finish the write of a slot, if any. Return 0 on success, -1 on error.
+    int complete_write(slot & s)
+    {
+        std::size_t i = &s - &slot_v[0];
+        while (s.done < s.len)
+        {
+            long res = 0;
+            if (ring_p)
+            {
+                if (not s.in_flight) ring_p->push(true, fd, s.buff + s.done, s.len - s.done, s.off + s.done, i);
+                res = ring_p->wait(i);
+                s.in_flight = false;
+            }
+            else
+            {
+#ifndef _WIN32
+                res = ::pwrite(fd, s.buff + s.done, s.len - s.done, s.off + s.done);
+                if (res < 0) res = -errno;
+#endif
+            }
+            if (res == -EINTR or res == -EAGAIN) continue;
+            if (res <= 0) return -1;
+            s.done += res;
+        }
+        return 0;
+    }
+
+    int fd;
+    detail::io_uring_queue * ring_p;
+    bool is_output;
+    std::size_t buff_size;
+    std::vector< slot > slot_v;
+    std::size_t crt;
+    std::uint64_t offset;
+    bool holding;
+    bool at_end;
+    bool failed;
+}; // class uring_streambuf
+
+class istreambuf
+    : public std::streambuf
+{
+public:
+    static const std::size_t default_buff_size = (std::size_t)1 << 20;
+
+    /// Auto-detection recognizes gzip, zlib, zstd (see ZSTR_WITH_ZSTD) and
+    /// LZ4 frame (see ZSTR_WITH_LZ4) input; anything else is passed through
+    /// as text.
+    /// With _threads > 0, gzip input made of several members (such as BGZF)
+    /// is decompressed in parallel by that many worker threads; so is a
+    /// single member, given a checkpoint index (see set_index()). With
+    /// _readahead > 0, a background thread reads ahead from the source into a
+    /// ring of that many buffers of _buff_size bytes (see readahead_streambuf).
+    /// An in_place_source, such as mmap_streambuf, readahead_streambuf or
+    /// uring_streambuf, is read in place, without copies. With a
+    /// seekable source, seekg() works on uncompressed offsets: directly for
+    /// uncompressed input, or using a checkpoint index (see set_index()).
+    istreambuf(std::streambuf * _sbuf_p,
+               std::size_t _buff_size = default_buff_size, bool _auto_detect = true,
+               unsigned _threads = 0, unsigned _readahead = 0)
+        : istreambuf(_sbuf_p, memory_profile(_buff_size), _auto_detect, _threads, _readahead)
+    {}
+
+    /// Use the buffer size, laziness and allocator of the given memory profile.
+    istreambuf(std::streambuf * _sbuf_p, const memory_profile & _mem, bool _auto_detect = true,
+               unsigned _threads = 0, unsigned _readahead = 0)
+        : sbuf_p(_sbuf_p),
+          in_buff(nullptr),
+          out_buff(nullptr),
+          zstrm_p(nullptr),
+          zstd_p(nullptr),
+          lz4_p(nullptr),
+          inf_p(nullptr),
+          ra_p(nullptr),
+          src_p(nullptr),
+          io_p(nullptr),
+          idx_rec_p(nullptr),
+          has_idx(false),
+          alloc_p(_mem.alloc_p),
+          buff_size(_mem.buff_size),
+          threads(_threads),
+          in_total(0),
+          out_total(0),
+          idx_span(0),
+          skip_in(0),
+          trailer_size(8),
+          raw_mode(false),
+          raw_input(false),
+          auto_detect(_auto_detect),
+          auto_detect_run(false),
+          is_text(false),
+          is_zstd(false),
+          is_lz4(false)
+    {
+        assert(sbuf_p);
+        if (_readahead > 0)
+        {
+            ra_p = new readahead_streambuf(sbuf_p, buff_size, _readahead);
+            sbuf_p = ra_p;
+        }
+        src_p = dynamic_cast< in_place_source * >(sbuf_p);
+        if (detail::stats_enabled and ! src_p)
+        {
+            io_p = new detail::stats_streambuf(sbuf_p, st);
+            sbuf_p = io_p;
+        }
+        in_buff_start = nullptr;
+        in_buff_end = nullptr;
+        setg(nullptr, nullptr, nullptr);
+        if (! _mem.lazy) allocate_buffers();
+    }
+
+    istreambuf(const istreambuf &) = delete;
+    istreambuf(istreambuf &&) = default;
+    istreambuf & operator = (const istreambuf &) = delete;
+    istreambuf & operator = (istreambuf &&) = default;
+
+    virtual ~istreambuf()
+    {
+        buffer_pool::shared().put(in_buff, buff_size);
+        buffer_pool::shared().put(out_buff, buff_size);
+        if (zstrm_p) delete zstrm_p;
+        if (zstd_p) delete zstd_p;
+        if (lz4_p) delete lz4_p;
+        if (inf_p) delete inf_p;
+        if (ra_p) delete ra_p;
+        if (io_p) delete io_p;
+    }
+
+    virtual std::streambuf::int_type underflow()
+    {
+        if (detail::stats_enabled) ++st.calls;
+        if (! out_buff) allocate_buffers();
+        if (this->gptr() == this->egptr() && ! inf_p)
+        {
+            // pointers for free region in output buffer
+            char * out_buff_free_start = out_buff;
+            // with an in-place source, uncompressed input is served from it
+            char * view_start = nullptr;
+            char * view_end = nullptr;
+            do
+            {
+                // read more input if none available
+                if (in_buff_start == in_buff_end)
+                {
+                    if (src_p)
+                    {
+                        // use the source data as input buffer
+                        std::size_t sz;
+                        {
+                            detail::stats_timer t(st.io_ns);
+                            sz = src_p->take(in_buff_start, max_view_size);
+                        }
+                        if (detail::stats_enabled) st.bytes_in += sz;
+                        in_buff_end = in_buff_start + sz;
+                        if (sz == 0) break; // end of input
+                    }
+                    else
+                    {
+                        // empty input buffer: refill from the start
+                        in_buff_start = in_buff;
+                        std::streamsize sz = sbuf_p->sgetn(in_buff, buff_size);
+                        in_buff_end = in_buff + sz;
+                        if (in_buff_end == in_buff_start) break; // end of input
+                    }
+                }
+                // skip the trailer of a member whose deflate data was read in raw mode
+                if (skip_in > 0)
+                {
+                    std::size_t sz = std::min< std::size_t >(skip_in, in_buff_end - in_buff_start);
+                    in_buff_start += sz;
+                    in_total += sz;
+                    skip_in -= sz;
+                    continue;
+                }
+                // auto detect if the stream contains text, deflate, zstd or lz4 data
+                if (auto_detect && ! auto_detect_run)
+                {
+                    auto_detect_run = true;
+                    std::size_t sz = in_buff_end - in_buff_start;
+                    is_text = ! is_compressed(in_buff_start, sz);
+                    if (*in_buff_start == 0x78) trailer_size = 4;
+                    is_zstd = (sz >= 4 && detail::zstd_stream_wrapper::is_magic(in_buff_start));
+                    is_lz4 = (sz >= 4 && detail::lz4_stream_wrapper::is_magic(in_buff_start));
+                }
+                // with worker threads, hand gzip input over to the parallel inflater
+                if (threads > 0 && ! idx_rec_p)
+                {
+                    if (! is_text && in_buff_start + 2 <= in_buff_end
+                        && static_cast< unsigned char >(in_buff_start[0]) == 0x1F
+                        && static_cast< unsigned char >(in_buff_start[1]) == 0x8B)
+                    {
+                        // an index from the start of the input lets single members be split as well
+                        bool use_idx = (has_idx && out_total == 0 && ! idx.checkpoints().empty()
+                                        && idx.checkpoints()[0].uoffset == 0);
+                        inf_p = new detail::parallel_inflater(sbuf_p, buff_size, threads,
+                                                              in_buff_start, in_buff_end - in_buff_start,
+                                                              use_idx? &idx : nullptr, in_total);
+                        in_buff_start = in_buff;
+                        in_buff_end = in_buff;
+                        threads = 0;
+                        break;
+                    }
+                    threads = 0;
+                }
+                if (is_text && src_p)
+                {
+                    view_start = in_buff_start;
+                    view_end = in_buff_end;
+                    in_total += view_end - view_start;
+                    out_total += view_end - view_start;
+                    in_buff_start = in_buff_end;
+                    break;
+                }
+                else if (is_text)
+                {
+                    // simply swap in_buff and out_buff, and adjust pointers
+                    assert(in_buff_start == in_buff);
+                    in_total += in_buff_end - in_buff_start;
+                    out_total += in_buff_end - in_buff_start;
+                    std::swap(in_buff, out_buff);
+                    out_buff_free_start = in_buff_end;
+                    in_buff_start = in_buff;
+                    in_buff_end = in_buff;
+                }
+                else if (is_zstd)
+                {
+                    if (! zstd_p) zstd_p = new detail::zstd_stream_wrapper(true);
+                    char * in_start = in_buff_start;
+                    char * out_start = out_buff_free_start;
+                    {
+                        detail::stats_timer t(st.codec_ns);
+                        zstd_p->decompress(in_buff_start, in_buff_end, out_buff_free_start, out_buff + buff_size);
+                    }
+                    in_total += in_buff_start - in_start;
+                    out_total += out_buff_free_start - out_start;
+                }
+                else if (is_lz4)
+                {
+                    if (! lz4_p) lz4_p = new detail::lz4_stream_wrapper(true);
+                    char * in_start = in_buff_start;
+                    char * out_start = out_buff_free_start;
+                    {
+                        detail::stats_timer t(st.codec_ns);
+                        lz4_p->decompress(in_buff_start, in_buff_end, out_buff_free_start, out_buff + buff_size);
+                    }
+                    in_total += in_buff_start - in_start;
+                    out_total += out_buff_free_start - out_start;
+                }
+                else
+                {
+                    // run inflate() on input
+                    if (! zstrm_p)
+                    {
+                        zstrm_p = new detail::z_stream_wrapper(true, Z_DEFAULT_COMPRESSION, raw_input? -15 : 0, 8, alloc_p);
+                        if (raw_input) load_dictionary();
+                    }
+                    zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(in_buff_start);
+                    zstrm_p->avail_in = in_buff_end - in_buff_start;
+                    zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out_buff_free_start);
+                    zstrm_p->avail_out = (out_buff + buff_size) - out_buff_free_start;
+                    // when recording an index, stop at every deflate block boundary
+                    int ret;
+                    {
+                        detail::stats_timer t(st.codec_ns);
+                        ret = inflate(zstrm_p, idx_rec_p? Z_BLOCK : Z_NO_FLUSH);
+                    }
+                    // process return code
+                    if (ret != Z_OK && ret != Z_STREAM_END) throw Exception(zstrm_p, ret);
+                    // update in&out pointers following inflate()
+                    in_total += reinterpret_cast< decltype(in_buff_start) >(zstrm_p->next_in) - in_buff_start;
+                    out_total += reinterpret_cast< decltype(out_buff_free_start) >(zstrm_p->next_out) - out_buff_free_start;
+                    in_buff_start = reinterpret_cast< decltype(in_buff_start) >(zstrm_p->next_in);
+                    in_buff_end = in_buff_start + zstrm_p->avail_in;
+                    out_buff_free_start = reinterpret_cast< decltype(out_buff_free_start) >(zstrm_p->next_out);
+                    assert(out_buff_free_start + zstrm_p->avail_out == out_buff + buff_size);
+                    if (idx_rec_p && ret == Z_OK) record_checkpoint();
+                    // if stream ended, reset the inflator for the next member, if any
+                    if (ret == Z_STREAM_END)
+                    {
+                        if (detail::stats_enabled) ++st.members;
+                        if (raw_mode)
+                        {
+                            // resumed from a checkpoint: the gzip or zlib trailer is left in the input
+                            skip_in = trailer_size;
+                            raw_mode = false;
+                            ret = inflateReset2(zstrm_p, 15+32);
+                        }
+                        else
+                        {
+                            ret = inflateReset(zstrm_p);
+                            if (ret == Z_OK and raw_input) load_dictionary();
+                        }
+                        if (ret != Z_OK) throw Exception(zstrm_p, ret);
+                    }
+                }
+            } while (out_buff_free_start == out_buff);
+            // 2 exit conditions:
+            // - end of input: there might or might not be output available
+            // - out_buff_free_start != out_buff: output available
+            if (view_start)
+            {
+                this->setg(view_start, view_start, view_end);
+            }
+            else
+            {
+                this->setg(out_buff, out_buff, out_buff_free_start);
+            }
+            if (detail::stats_enabled) st.bytes_out += this->egptr() - this->gptr();
+        }
+        if (this->gptr() == this->egptr() && inf_p)
+        {
+            char * data;
+            std::size_t sz;
+            bool got;
+            std::uint64_t io_ns = st.io_ns;
+            {
+                detail::stats_timer t(st.codec_ns);
+                got = inf_p->next(data, sz);
+            }
+            // the input read meanwhile is counted as I/O
+            st.codec_ns -= st.io_ns - io_ns;
+            if (got)
+            {
+                this->setg(data, data, data + sz);
+                if (detail::stats_enabled) st.bytes_out += sz;
+            }
+        }
+        return this->gptr() == this->egptr()
+            ? traits_type::eof()
+            : traits_type::to_int_type(*this->gptr());
+    }
+
+    /// Whether auto-detection takes data starting with the given size bytes
+    /// as compressed: as gzip, zlib, zstd or LZ4 frame. Anything else is text.
+    static bool is_compressed(const char * p, std::size_t size)
+    {
+        if (size < 2) return false;
+        unsigned char b0 = static_cast< unsigned char >(p[0]);
+        unsigned char b1 = static_cast< unsigned char >(p[1]);
+        // Ref:
+        // http://en.wikipedia.org/wiki/Gzip
+        // http://stackoverflow.com/questions/9050260/what-does-a-zlib-header-look-like
+        return ((b0 == 0x1F && b1 == 0x8B)                              // gzip header
+                || (b0 == 0x78 && (b1 == 0x01 || b1 == 0x9C || b1 == 0xDA)) // zlib header
+                || (size >= 4 && (detail::zstd_stream_wrapper::is_magic(p)
+                                  || detail::lz4_stream_wrapper::is_magic(p))));
+    }
+
+    /// Counters, with ZSTR_WITH_STATS; see stream_stats.
+    const stream_stats & stats() const { return st; }
+
+    /// Zero-copy access to the uncompressed data, bypassing the character
+    /// interface: return the next block of data, as a pointer and a length.
+    /// The length is 0 at the end of the input. The block is taken directly
+    /// from the output buffer, and it stays valid until the next call, or the
+    /// next read through the character interface.
+    std::pair< const char *, std::size_t > next_block()
+    {
+        if (this->gptr() == this->egptr()) underflow();
+        std::pair< const char *, std::size_t > res(this->gptr(), this->egptr() - this->gptr());
+        this->setg(this->eback(), this->egptr(), this->egptr());
+        return res;
+    }
+
+    /// Record a checkpoint index in *_idx_p while reading, with checkpoints
+    /// about every _span bytes of uncompressed data. Must be called before
+    /// any data is read. Disables parallel decompression.
+    void record_index(gzip_index * _idx_p, std::uint64_t _span = default_index_span)
+    {
+        assert(out_total == 0);
+        idx_rec_p = _idx_p;
+        idx_span = _span;
+    }
+
+    /// Use the given checkpoint index to seek in compressed input. With
+    /// worker threads, and if called before any data is read, the index is
+    /// also used to decompress the input in parallel, one segment between two
+    /// checkpoints at a time. The index must then match the whole input.
+    void set_index(const gzip_index & _idx)
+    {
+        assert(! inf_p);
+        idx = _idx;
+        has_idx = true;
+    }
+
+    /// Read raw deflate input (see format::raw), written with the given
+    /// preset dictionary, which may be empty: each stream is decompressed
+    /// as if preceded by the dictionary. This turns off auto-detection and
+    /// parallel decompression, and does not work with checkpoint indexes.
+    /// Must be called before any data is read.
+    void set_dictionary(const std::string & _dict)
+    {
+        assert(out_total == 0 and ! zstrm_p and ! has_idx and ! idx_rec_p);
+        dict = _dict;
+        raw_input = true;
+        auto_detect = false;
+        threads = 0;
+    }
+
+    virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir dir,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        // current uncompressed offset
+        off_type crt = out_total - (this->egptr() - this->gptr());
+        if (dir == std::ios_base::cur and off == 0) return crt;
+        if (dir == std::ios_base::end) return pos_type(off_type(-1));
+        return seekpos(dir == std::ios_base::beg? off : crt + off, which);
+    }
+
+    virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type sp,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        off_type target = sp;
+        if (not (which & std::ios_base::in) or target < 0 or inf_p or idx_rec_p) return pos_type(off_type(-1));
+        // run auto-detection, if not done yet
+        if (auto_detect && ! auto_detect_run) underflow();
+        if (inf_p or is_zstd or is_lz4) return pos_type(off_type(-1));
+        if (is_text)
+        {
+            if (sbuf_p->pubseekpos(target, std::ios_base::in) != pos_type(target)) return pos_type(off_type(-1));
+            in_total = out_total = target;
+        }
+        else
+        {
+            const gzip_index::checkpoint * cp_p = has_idx? idx.lookup(target) : nullptr;
+            if (! cp_p) return pos_type(off_type(-1));
+            off_type pos = cp_p->coffset - (cp_p->bits? 1 : 0);
+            if (sbuf_p->pubseekpos(pos, std::ios_base::in) != pos_type(pos)) return pos_type(off_type(-1));
+            // resume inflating raw deflate data at the checkpoint
+            if (zstrm_p)
+            {
+                int ret = inflateReset2(zstrm_p, -15);
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+            }
+            else
+            {
+                zstrm_p = new detail::z_stream_wrapper(true, Z_DEFAULT_COMPRESSION, -15, 8, alloc_p);
+            }
+            raw_mode = true;
+            skip_in = 0;
+            if (cp_p->bits)
+            {
+                char c;
+                if (sbuf_p->sgetn(&c, 1) != 1) return pos_type(off_type(-1));
+                int ret = inflatePrime(zstrm_p, cp_p->bits, static_cast< unsigned char >(c) >> (8 - cp_p->bits));
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+            }
+            if (not cp_p->window.empty())
+            {
+                int ret = inflateSetDictionary(zstrm_p, reinterpret_cast< const Bytef * >(cp_p->window.data()),
+                                               cp_p->window.size());
+                if (ret != Z_OK) throw Exception(zstrm_p, ret);
+            }
+            in_total = cp_p->coffset;
+            out_total = cp_p->uoffset;
+        }
+        in_buff_start = in_buff;
+        in_buff_end = in_buff;
+        this->setg(out_buff, out_buff, out_buff);
+        // inflate and discard data up to the target
+        while (out_total < static_cast< std::uint64_t >(target))
+        {
+            this->setg(this->eback(), this->egptr(), this->egptr());
+            if (traits_type::eq_int_type(underflow(), traits_type::eof())) return pos_type(off_type(-1));
+        }
+        this->setg(this->eback(), this->egptr() - (out_total - target), this->egptr());
+        return sp;
+    }
+
+    static const std::uint64_t default_index_span = (std::uint64_t)1 << 22;
+
+private:
+    void allocate_buffers()
+    {
+        in_buff = src_p? nullptr : buffer_pool::shared().get(buff_size);
+        in_buff_start = in_buff;
+        in_buff_end = in_buff;
+        out_buff = buffer_pool::shared().get(buff_size);
+        setg(out_buff, out_buff, out_buff);
+    }
+
+    // Give a fresh raw inflate stream the preset dictionary.
+    void load_dictionary()
+    {
+        if (dict.empty()) return;
+        int ret = inflateSetDictionary(zstrm_p, reinterpret_cast< const Bytef * >(dict.data()), dict.size());
+        if (ret != Z_OK) throw Exception(zstrm_p, ret);
+    }
+
+    // Called after inflate() returns at a block boundary in Z_BLOCK mode.
+    void record_checkpoint()
+    {
+        // Ref: zran.c in the zlib distribution
+        // bit 7: at the end of a block or of the header; bit 6: after the last block
+        if (! (zstrm_p->data_type & 128) || (zstrm_p->data_type & 64)) return;
+        if (! idx_rec_p->checkpoints().empty()
+            && out_total - idx_rec_p->checkpoints().back().uoffset < idx_span) return;
+        gzip_index::checkpoint cp;
+        cp.uoffset = out_total;
+        cp.coffset = in_total;
+        cp.bits = zstrm_p->data_type & 7;
+        cp.window.resize(gzip_index::window_size);
+        uInt len = 0;
+        int ret = inflateGetDictionary(zstrm_p, reinterpret_cast< Bytef * >(&cp.window[0]), &len);
+        if (ret != Z_OK) throw Exception(zstrm_p, ret);
+        cp.window.resize(len);
+        idx_rec_p->add(std::move(cp));
+    }
+
+    std::streambuf * sbuf_p;
+    char * in_buff;
+    char * in_buff_start;
+    char * in_buff_end;
+    char * out_buff;
+    detail::z_stream_wrapper * zstrm_p;
+    detail::zstd_stream_wrapper * zstd_p;
+    detail::lz4_stream_wrapper * lz4_p;
+    detail::parallel_inflater * inf_p;
+    readahead_streambuf * ra_p;
+    in_place_source * src_p;
+    detail::stats_streambuf * io_p;
+    gzip_index * idx_rec_p;
+    gzip_index idx;
+    bool has_idx;
+    slab_allocator * alloc_p;
+    std::size_t buff_size;
+    unsigned threads;
+    std::uint64_t in_total;
+    std::uint64_t out_total;
+    std::uint64_t idx_span;
+    std::size_t skip_in;
+    std::size_t trailer_size;
+    std::string dict;
+    bool raw_mode;
+    bool raw_input;
+    bool auto_detect;
+    bool auto_detect_run;
+    bool is_text;
+    bool is_zstd;
+    bool is_lz4;
+    stream_stats st;
+
+    // limit on the input passed to a single inflate() call, whose avail_in is a uInt
+    static const std::size_t max_view_size = (std::size_t)1 << 30;
+}; // class istreambuf
+
+/// Line reader working directly on the decompressed data of an istreambuf.
+///
+/// Lines are returned as views, without their terminating '\n', and without
+/// copies: newlines are found with memchr(), which is vectorized in common C
+/// libraries, and a line is only copied when it crosses the boundary between
+/// two blocks of decompressed data. A view stays valid until the next call to
+/// next(). The reader consumes the data of the istreambuf block by block, so
+/// it should not be mixed with other reads from the same istreambuf.
+class line_reader
+{
+public:
+    struct line
+    {
+        const char * data;
+        std::size_t size;
+
+        std::string str() const { return std::string(data, size); }
+    }; // struct line
+
+    explicit line_reader(istreambuf & zsbuf)
+        : zsbuf_p(&zsbuf),
+          blk_start(nullptr),
+          blk_end(nullptr)
+    {}
+    /// Read from a zstr::istream or zstr::ifstream.
+    explicit line_reader(std::istream & is)
+        : zsbuf_p(dynamic_cast< istreambuf * >(is.rdbuf())),
+          blk_start(nullptr),
+          blk_end(nullptr)
+    {
+        if (not zsbuf_p) throw Exception("zstr: line_reader: not a zstr input stream");
+    }
+
+    /// Get the next line. Return false at the end of the input. As with
+    /// std::getline(), a last line without a final newline is returned.
+    bool next(line & l)
+    {
+        // the previous line, if stitched, is no longer needed
+        stitch.clear();
+        while (true)
+        {
+            if (blk_start == blk_end)
+            {
+                std::pair< const char *, std::size_t > blk = zsbuf_p->next_block();
+                if (blk.second == 0)
+                {
+                    if (stitch.empty()) return false;
+                    l.data = stitch.data();
+                    l.size = stitch.size();
+                    return true;
+                }
+                blk_start = blk.first;
+                blk_end = blk.first + blk.second;
+            }
+            const char * p = static_cast< const char * >(std::memchr(blk_start, '\n', blk_end - blk_start));
+            if (not p)
+            {
+                // the line continues in the next block
+                stitch.append(blk_start, blk_end);
+                blk_start = blk_end;
+                continue;
+            }
+            if (stitch.empty())
+            {
+                l.data = blk_start;
+                l.size = p - blk_start;
+            }
+            else
+            {
+                stitch.append(blk_start, p);
+                l.data = stitch.data();
+                l.size = stitch.size();
+            }
+            blk_start = p + 1;
+            return true;
+        }
+    }
+
+private:
+    istreambuf * zsbuf_p;
+    const char * blk_start;
+    const char * blk_end;
+    std::string stitch;
+}; // class line_reader
+
+/// Reader of FASTA and FASTQ records, working directly on the decompressed
+/// data of an istreambuf.
+///
+/// The format is detected from the first record. FASTQ records must have 4
+/// lines; FASTA sequences may span several lines. Records are found with
+/// memchr() in place, and returned as views into the decompressed data. A
+/// record is only copied when it crosses the boundary between two blocks of
+/// decompressed data, or when it is a FASTA record with a multi-line
+/// sequence, whose lines are joined. Views stay valid until the next call.
+///
+/// Records can also be copied into record objects, whose storage is reused
+/// from one call to the next. This fits the input items of pfor::pfor(),
+/// which are reused across chunks:
+///
+///     zstr::fastx_reader rdr(ifs);
+///     pfor::pfor< zstr::fastx_reader::record >(
+///         num_threads, chunk_size,
+///         [&] (zstr::fastx_reader::record& r) { return rdr.next(r); },
+///         [&] (zstr::fastx_reader::record& r) { process(r); });
+class fastx_reader
+{
+public:
+    typedef line_reader::line view;
+
+    /// Record fields, without the '@' or '>' marker on the name line. The
+    /// name is the whole header line. FASTA records have an empty quality.
+    struct record_view
+    {
+        view name;
+        view seq;
+        view qual;
+    }; // struct record_view
+
+    struct record
+    {
+        std::string name;
+        std::string seq;
+        std::string qual;
+    }; // struct record
+
+    explicit fastx_reader(istreambuf & zsbuf)
+        : zsbuf_p(&zsbuf),
+          blk_start(nullptr),
+          blk_end(nullptr),
+          marker(0)
+    {}
+    /// Read from a zstr::istream or zstr::ifstream.
+    explicit fastx_reader(std::istream & is)
+        : zsbuf_p(dynamic_cast< istreambuf * >(is.rdbuf())),
+          blk_start(nullptr),
+          blk_end(nullptr),
+          marker(0)
+    {
+        if (not zsbuf_p) throw Exception("zstr: fastx_reader: not a zstr input stream");
+    }
+
+    /// Get the next record. Return false at the end of the input.
+    bool next(record_view & r)
+    {
+        // the previous record, if stitched, is no longer needed
+        stitch.clear();
+        // skip empty lines between records
+        while (true)
+        {
+            while (blk_start < blk_end and *blk_start == '\n') ++blk_start;
+            if (blk_start < blk_end) break;
+            if (not next_block()) return false;
+        }
+        if (not marker)
+        {
+            if (*blk_start != '@' and *blk_start != '>') throw Exception("zstr: fastx_reader: unknown format");
+            marker = *blk_start;
+        }
+        // common case: the record is inside the current block
+        const char * end = record_end(blk_start, blk_end, false);
+        if (end)
+        {
+            parse(blk_start, end, r);
+            blk_start = end;
+            return true;
+        }
+        // otherwise, copy the record into the stitch buffer, in growing pieces
+        stitch.assign(blk_start, blk_end);
+        blk_start = blk_end;
+        while (true)
+        {
+            bool eof = (blk_start == blk_end and not next_block());
+            std::size_t old_size = stitch.size();
+            std::size_t piece = std::min< std::size_t >(blk_end - blk_start, std::max< std::size_t >(stitch.size(), 4096));
+            stitch.append(blk_start, piece);
+            end = record_end(stitch.data(), stitch.data() + stitch.size(), eof);
+            if (end)
+            {
+                std::size_t sz = end - stitch.data();
+                // return the unused part of the piece to the block
+                blk_start += sz - old_size;
+                stitch.resize(sz);
+                parse(stitch.data(), stitch.data() + sz, r);
+                return true;
+            }
+            if (eof) throw Exception("zstr: fastx_reader: truncated record");
+            blk_start += piece;
+        }
+    }
+
+    /// Get the next record, copied into r.
+    bool next(record & r)
+    {
+        record_view v;
+        if (not next(v)) return false;
+        r.name.assign(v.name.data, v.name.size);
+        r.seq.assign(v.seq.data, v.seq.size);
+        r.qual.assign(v.qual.data, v.qual.size);
+        return true;
+    }
+
+private:
+    bool next_block()
+    {
+        std::pair< const char *, std::size_t > blk = zsbuf_p->next_block();
+        blk_start = blk.first;
+        blk_end = blk.first + blk.second;
+        return blk.second > 0;
+    }
+
+    // End of the record starting at p, if it is complete in [p, e): in FASTQ,
+    // past the 4th newline; in FASTA, at the next '>' starting a line. With
+    // eof set, a record may end at e. Return null if more data is needed.
+    const char * record_end(const char * p, const char * e, bool eof) const
+    {
+        if (marker == '@')
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                const char * q = static_cast< const char * >(std::memchr(p, '\n', e - p));
+                // at eof, the quality line may lack its newline, or be empty
+                if (not q) return eof and i == 3? e : nullptr;
+                p = q + 1;
+            }
+            return p;
+        }
+        const char * q = static_cast< const char * >(std::memchr(p, '\n', e - p));
+        while (q and q + 1 < e and q[1] != '>') q = static_cast< const char * >(std::memchr(q + 1, '\n', e - q - 1));
+        return q and q + 1 < e? q + 1 : eof? e : nullptr;
+    }
+
+    // Split the complete record [p, e) into fields.
+    void parse(const char * p, const char * e, record_view & r)
+    {
+        if (*p != marker) throw Exception("zstr: fastx_reader: invalid record");
+        view lines[4];
+        int n = 0;
+        for (; (p < e or (marker == '@' and n == 3)) and n < (marker == '@'? 4 : 2); ++n)
+        {
+            const char * q = marker == '@' or n == 0? static_cast< const char * >(std::memchr(p, '\n', e - p)) : nullptr;
+            if (not q) q = e;
+            lines[n].data = p;
+            lines[n].size = q - p;
+            p = q < e? q + 1 : e;
+        }
+        r.name.data = lines[0].data + 1;
+        r.name.size = lines[0].size - 1;
+        if (marker == '@')
+        {
+            if (n < 4 or lines[2].size == 0 or *lines[2].data != '+' or lines[3].size != lines[1].size)
+            {
+                throw Exception("zstr: fastx_reader: invalid FASTQ record");
+            }
+            r.seq = lines[1];
+            r.qual = lines[3];
+            return;
+        }
+        // FASTA: the sequence is the rest of the record, without newlines
+        r.seq.data = n > 1? lines[1].data : e;
+        r.seq.size = n > 1? lines[1].size : 0;
+        while (r.seq.size > 0 and r.seq.data[r.seq.size - 1] == '\n') --r.seq.size;
+        if (std::memchr(r.seq.data, '\n', r.seq.size))
+        {
+            seq_buff.clear();
+            const char * q_end = r.seq.data + r.seq.size;
+            for (const char * q = r.seq.data; q < q_end; )
+            {
+                const char * nl = static_cast< const char * >(std::memchr(q, '\n', q_end - q));
+                if (not nl) nl = q_end;
+                seq_buff.append(q, nl);
+                q = nl + 1;
+            }
+            r.seq.data = seq_buff.data();
+            r.seq.size = seq_buff.size();
+        }
+        r.qual.data = r.seq.data;
+        r.qual.size = 0;
+    }
+
+    istreambuf * zsbuf_p;
+    const char * blk_start;
+    const char * blk_end;
+    std::string stitch;
+    std::string seq_buff;
+    char marker;
+}; // class fastx_reader
+
+class ostreambuf
+    : public std::streambuf
+{
+public:
+    static const std::size_t default_buff_size = (std::size_t)1 << 20;
+
+    /// With _threads > 0, compression is done in parallel by that many worker
+    /// threads, in blocks of _buff_size bytes. In gzip format, the output is a
+    /// single gzip member per sync() call, as in the sequential mode. In BGZF
+    /// format, _buff_size is ignored: blocks hold at most 0xFF00 bytes, sync()
+    /// ends the current block, and the EOF marker is written on destruction.
+    /// In zstd format, _threads > 0 sets the number of zstd's own compression
+    /// workers, and the zlib default level selects zstd's default level.
+    /// In lz4 format, _threads is ignored, the zlib default level selects
+    /// LZ4's fast mode, and levels above 2 select LZ4-HC. In raw format,
+    /// _threads is ignored.
+    ostreambuf(std::streambuf * _sbuf_p,
+               std::size_t _buff_size = default_buff_size, int _level = Z_DEFAULT_COMPRESSION,
+               unsigned _threads = 0, format _fmt = format::gzip)
+        : ostreambuf(_sbuf_p, memory_profile(_buff_size), _level, _threads, _fmt)
+    {}
+
+    /// Use the settings of the given memory profile. With a lazy profile,
+    /// nothing is allocated before the first write or sync().
+    ostreambuf(std::streambuf * _sbuf_p, const memory_profile & _mem, int _level = Z_DEFAULT_COMPRESSION,
+               unsigned _threads = 0, format _fmt = format::gzip)
+        : sbuf_p(_sbuf_p),
+          in_buff(nullptr),
+          out_buff(nullptr),
+          zstrm_p(nullptr),
+          zstd_p(nullptr),
+          lz4_p(nullptr),
+          blk_p(nullptr),
+          wb_p(nullptr),
+          io_p(nullptr),
+          mem(_mem),
+          buff_size(_fmt == format::bgzf? detail::block_deflater::bgzf_max_block_size : _mem.buff_size),
+          threads(_fmt == format::raw? 0 : _threads),
+          fmt(_fmt),
+          allocated(false),
+          level(_level),
+          min_level(_level),
+          max_level(_level),
+          target_mbps(0),
+          adaptive(false),
+          deflate_time(0),
+          sink_time(0)
+    {
+        assert(sbuf_p);
+        if (detail::stats_enabled)
+        {
+            io_p = new detail::stats_streambuf(sbuf_p, st);
+            sbuf_p = io_p;
+        }
+        if (! mem.lazy) allocate();
+    }
+
+    ostreambuf(const ostreambuf &) = delete;
+    ostreambuf(ostreambuf &&) = default;
+    ostreambuf & operator = (const ostreambuf &) = delete;
+    ostreambuf & operator = (ostreambuf &&) = default;
+
+    /// Adapt the compression level after every block of _buff_size bytes,
+    /// within [_min_level, _max_level], using deflateParams(). With
+    /// _target_mbps > 0, aim for a deflate throughput of that many MB/s of
+    /// uncompressed data. Otherwise, aim for deflate to never be the
+    /// bottleneck: lower the level when deflating a block takes longer than
+    /// writing its output to the sink, raise it when it takes less than half
+    /// as long. Only sequential gzip output supports this.
+    void set_adaptive_level(int _min_level, int _max_level, double _target_mbps = 0)
+    {
+        if ((fmt != format::gzip and fmt != format::raw) or threads > 0)
+        {
+            throw Exception("zstr: adaptive level requires sequential gzip or raw output");
+        }
+        if (not allocated) allocate();
+        assert(0 <= _min_level and _min_level <= _max_level and _max_level <= 9);
+        // the settings below are used by the write-behind thread
+        if (wb_p and wb_p->wait() != 0)
+        {
+            setp(nullptr, nullptr);
+            return;
+        }
+        min_level = _min_level;
+        max_level = _max_level;
+        target_mbps = _target_mbps;
+        adaptive = true;
+        deflate_time = 0;
+        sink_time = 0;
+        int new_level = std::min(std::max(level != Z_DEFAULT_COMPRESSION? level : 6, min_level), max_level);
+        if (change_level(new_level) != 0) setp(nullptr, nullptr);
+    }
+    /// Compression level in use. With write-behind, the level is updated by
+    /// the background thread as it compresses the buffers submitted so far,
+    /// so it may lag behind the data written until sync().
+    int current_level() const
+    {
+        if (not wb_p) return level;
+        int res;
+        wb_p->locked([&] () { res = level; });
+        return res;
+    }
+
+    /// Counters, with ZSTR_WITH_STATS; see stream_stats.
+    const stream_stats & stats() const { return st; }
+
+    /// Compress every raw deflate stream (see format::raw), i.e. every record
+    /// ended by sync(), as if preceded by the given preset dictionary: short
+    /// records then compress much better than as separate gzip members. Only
+    /// the last 2^window_bits bytes (32KB by default) of the dictionary are
+    /// used; examples/zdict.cpp trains one from sample records. The reader
+    /// needs the same dictionary (see istreambuf::set_dictionary()). Must be
+    /// called before any data is written.
+    void set_dictionary(const std::string & _dict)
+    {
+        if (fmt != format::raw) throw Exception("zstr: a preset dictionary requires raw deflate output");
+        if (not allocated) allocate();
+        assert(pptr() == pbase());
+        dict = _dict;
+        load_dictionary();
+    }
+
+    /// Write-behind mode: overflow() hands each full buffer over to a
+    /// background thread, which compresses it and writes the output to the
+    /// sink, while the caller goes on filling a fresh buffer. At most _depth
+    /// buffers are in flight. sync() waits for all of them, and errors in the
+    /// background thread (including exceptions) are reported by the next
+    /// write or sync(). The output is identical to the sequential mode. Only
+    /// sequential gzip output supports this, and it must be enabled before
+    /// any data is written. (With _threads > 0, compression is already done
+    /// by worker threads.)
+    void set_write_behind(unsigned _depth = 2)
+    {
+        if ((fmt != format::gzip and fmt != format::raw) or threads > 0)
+        {
+            throw Exception("zstr: write-behind requires sequential gzip or raw output");
+        }
+        if (not allocated) allocate();
+        assert(not wb_p and pptr() == pbase());
+        wb_p = new detail::write_behind([this] (char * data, std::size_t sz, bool finish) {
+                return deflate_block(data, sz, finish);
+            }, buff_size, _depth);
+        buffer_pool::shared().put(in_buff, buff_size);
+        in_buff = wb_p->buffer();
+        setp(in_buff, in_buff + buff_size);
+    }
+
+    int deflate_loop(int flush)
+    {
+        while (true)
+        {
+            zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out_buff);
+            zstrm_p->avail_out = buff_size;
+            // with an adaptive level, time deflate() and the sink separately
+            std::chrono::steady_clock::time_point t0, t1;
+            if (adaptive) t0 = std::chrono::steady_clock::now();
+            int ret;
+            {
+                detail::stats_timer t(st.codec_ns);
+                ret = deflate(zstrm_p, flush);
+            }
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throw Exception(zstrm_p, ret);
+            if (adaptive) t1 = std::chrono::steady_clock::now();
+            std::streamsize sz = sbuf_p->sputn(out_buff, reinterpret_cast< decltype(out_buff) >(zstrm_p->next_out) - out_buff);
+            if (adaptive)
+            {
+                deflate_time += std::chrono::duration< double >(t1 - t0).count();
+                sink_time += std::chrono::duration< double >(std::chrono::steady_clock::now() - t1).count();
+            }
+            if (sz != reinterpret_cast< decltype(out_buff) >(zstrm_p->next_out) - out_buff)
+            {
+                // there was an error in the sink stream
+                return -1;
+            }
+            if (ret == Z_STREAM_END || ret == Z_BUF_ERROR || sz == 0)
+            {
+                break;
+            }
+        }
+        return 0;
+    }
+
+    // Compress [in_start, in_end) with zstd and write the output; with end
+    // set, also end the frame. Return 0 on success, -1 on sink error.
+    int zstd_loop(const char * in_start, const char * in_end, bool end)
+    {
+        while (true)
+        {
+            char * out_end = out_buff;
+            std::size_t rem;
+            {
+                detail::stats_timer t(st.codec_ns);
+                rem = zstd_p->compress(in_start, in_end, out_end, out_buff + buff_size, end);
+            }
+            if (sbuf_p->sputn(out_buff, out_end - out_buff) != out_end - out_buff)
+            {
+                // there was an error in the sink stream
+                return -1;
+            }
+            if (in_start == in_end and (not end or rem == 0)) break;
+        }
+        return 0;
+    }
+
+    // Compress [in_start, in_end) with lz4 and write the output; with end
+    // set, also end the frame. Return 0 on success, -1 on sink error.
+    int lz4_write(const char * in_start, const char * in_end, bool end)
+    {
+        std::streamsize sz;
+        {
+            detail::stats_timer t(st.codec_ns);
+            sz = lz4_p->compress(in_start, in_end - in_start, end);
+        }
+        return sbuf_p->sputn(lz4_p->output(), sz) == sz? 0 : -1;
+    }
+
+    virtual ~ostreambuf()
+    {
+        // flush the zlib stream
+        //
+        // NOTE: Errors here (sync() return value not 0) are ignored, because we
+        // cannot throw in a destructor. This mirrors the behaviour of
+        // std::basic_filebuf::~basic_filebuf(). To see an exception on error,
+        // close the ofstream with an explicit call to close(), and do not rely
+        // on the implicit call in the destructor.
+        //
+        sync();
+        if (blk_p)
+        {
+            // in_buff is owned by the block deflater
+            blk_p->close();
+            delete blk_p;
+        }
+        else
+        {
+            if (wb_p)
+            {
+                // in_buff is owned by the write-behind thread
+                delete wb_p;
+                in_buff = nullptr;
+            }
+            buffer_pool::shared().put(in_buff, buff_size);
+            buffer_pool::shared().put(out_buff, buff_size);
+            delete zstrm_p;
+            delete zstd_p;
+            delete lz4_p;
+        }
+        delete io_p;
+    }
+    virtual std::streambuf::int_type overflow(std::streambuf::int_type c = traits_type::eof())
+    {
+        if (not allocated) allocate();
+        if (detail::stats_enabled)
+        {
+            ++st.calls;
+            st.bytes_in += pptr() - pbase();
+        }
+        if (blk_p)
+        {
+            if (pptr() > pbase())
+            {
+                if (block_wait([&] () { return blk_p->submit(pptr() - pbase(), false); }) != 0)
+                {
+                    setp(nullptr, nullptr);
+                    return traits_type::eof();
+                }
+                in_buff = blk_p->buffer();
+            }
+            setp(in_buff, in_buff + buff_size);
+            return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::eof() : sputc(c);
+        }
+        if (zstd_p or lz4_p)
+        {
+            int r = 0;
+            if (pptr() > pbase())
+            {
+                r = zstd_p? zstd_loop(pbase(), pptr(), false) : lz4_write(pbase(), pptr(), false);
+            }
+            if (r != 0)
+            {
+                setp(nullptr, nullptr);
+                return traits_type::eof();
+            }
+            setp(in_buff, in_buff + buff_size);
+            return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::eof() : sputc(c);
+        }
+        if (wb_p)
+        {
+            if (pptr() > pbase() and wb_p->submit(pptr() - pbase(), false) != 0)
+            {
+                setp(nullptr, nullptr);
+                return traits_type::eof();
+            }
+            in_buff = wb_p->buffer();
+        }
+        else if (deflate_block(pbase(), pptr() - pbase(), false) != 0)
+        {
+            setp(nullptr, nullptr);
+            return traits_type::eof();
+        }
+        setp(in_buff, in_buff + buff_size);
+        return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::eof() : sputc(c);
+    }
+    virtual int sync()
+    {
+        if (not allocated) allocate();
+        if (detail::stats_enabled) st.bytes_in += pptr() - pbase();
+        if (blk_p)
+        {
+            // submit the data buffered so far as the last block of the gzip member,
+            // or as a final short block in BGZF mode
+            if (! pptr()) return -1;
+            if (block_wait([&] () { return blk_p->submit(pptr() - pbase(), true) != 0 or blk_p->flush() != 0? -1 : 0; }) != 0)
+            {
+                setp(nullptr, nullptr);
+                return -1;
+            }
+            if (detail::stats_enabled and fmt == format::gzip) ++st.members;
+            in_buff = blk_p->buffer();
+            setp(in_buff, in_buff + buff_size);
+            return 0;
+        }
+        if (zstd_p or lz4_p)
+        {
+            // end the zstd or lz4 frame; the next write starts a new one
+            if (! pptr()) return -1;
+            if ((zstd_p? zstd_loop(pbase(), pptr(), true) : lz4_write(pbase(), pptr(), true)) != 0)
+            {
+                setp(nullptr, nullptr);
+                return -1;
+            }
+            setp(in_buff, in_buff + buff_size);
+            return 0;
+        }
+        // compress the data in in_buff and finish the gzip member
+        if (! pptr()) return -1;
+        if (wb_p)
+        {
+            if (wb_p->submit(pptr() - pbase(), true) != 0 or wb_p->wait() != 0)
+            {
+                setp(nullptr, nullptr);
+                return -1;
+            }
+            in_buff = wb_p->buffer();
+        }
+        else if (deflate_block(pbase(), pptr() - pbase(), true) != 0)
+        {
+            setp(nullptr, nullptr);
+            return -1;
+        }
+        setp(in_buff, in_buff + buff_size);
+        return 0;
+    }
+private:
+    void allocate()
+    {
+        allocated = true;
+        if (fmt == format::zstd)
+        {
+            zstd_p = new detail::zstd_stream_wrapper(false, level, threads);
+            in_buff = buffer_pool::shared().get(buff_size);
+            out_buff = buffer_pool::shared().get(buff_size);
+        }
+        else if (fmt == format::lz4)
+        {
+            // the output buffer is owned by the wrapper
+            lz4_p = new detail::lz4_stream_wrapper(false, level, buff_size);
+            in_buff = buffer_pool::shared().get(buff_size);
+        }
+        else if (threads > 0 or fmt == format::bgzf)
+        {
+            blk_p = new detail::block_deflater(sbuf_p, buff_size, level, threads, fmt == format::bgzf);
+            in_buff = blk_p->buffer();
+        }
+        else
+        {
+            zstrm_p = new detail::z_stream_wrapper(false, level, fmt == format::raw? -mem.window_bits : mem.window_bits + 16,
+                                                   mem.mem_level, mem.alloc_p);
+            in_buff = buffer_pool::shared().get(buff_size);
+            out_buff = buffer_pool::shared().get(buff_size);
+        }
+        setp(in_buff, in_buff + buff_size);
+    }
+
+    // Deflate sz bytes of data and write the output; with finish set, also
+    // end the gzip member. Return 0 on success, -1 on sink error.
+    int deflate_block(char * data, std::size_t sz, bool finish)
+    {
+        zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(data);
+        zstrm_p->avail_in = sz;
+        while (zstrm_p->avail_in > 0)
+        {
+            if (deflate_loop(Z_NO_FLUSH) != 0) return -1;
+        }
+        // adapt the level after full blocks only, not after the partial ones flushed by sync()
+        if (adaptive and sz == buff_size and adapt_level() != 0) return -1;
+        if (finish)
+        {
+            zstrm_p->next_in = nullptr;
+            zstrm_p->avail_in = 0;
+            if (deflate_loop(Z_FINISH) != 0) return -1;
+            deflateReset(zstrm_p);
+            load_dictionary();
+            if (detail::stats_enabled) ++st.members;
+        }
+        return 0;
+    }
+
+    // Give a fresh raw deflate stream the preset dictionary.
+    void load_dictionary()
+    {
+        if (dict.empty()) return;
+        int ret = deflateSetDictionary(zstrm_p, reinterpret_cast< const Bytef * >(dict.data()), dict.size());
+        if (ret != Z_OK) throw Exception(zstrm_p, ret);
+    }
+
+    // Run a call into the block deflater, counting the time it takes, other
+    // than writing to the sink, as waiting for the worker threads.
+    template < typename Function >
+    int block_wait(Function f)
+    {
+        std::uint64_t io_ns = st.io_ns;
+        int res;
+        {
+            detail::stats_timer t(st.codec_ns);
+            res = f();
+        }
+        st.codec_ns -= st.io_ns - io_ns;
+        return res;
+    }
+
+    // Pick the level for the next block, from the timings of the last one.
+    int adapt_level()
+    {
+        int new_level = level;
+        if (target_mbps > 0)
+        {
+            double target = target_mbps * (1 << 20) * deflate_time;
+            if (buff_size < target) --new_level;
+            else if (buff_size > 2 * target) ++new_level;
+        }
+        else
+        {
+            if (deflate_time > sink_time) --new_level;
+            else if (2 * deflate_time < sink_time) ++new_level;
+        }
+        deflate_time = 0;
+        sink_time = 0;
+        return change_level(std::min(std::max(new_level, min_level), max_level));
+    }
+
+    // Switch to a new level. deflateParams() may have to compress pending
+    // data with the old level, so give it output space and write that out.
+    int change_level(int new_level)
+    {
+        if (new_level == level) return 0;
+        zstrm_p->next_in = nullptr;
+        zstrm_p->avail_in = 0;
+        while (true)
+        {
+            zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out_buff);
+            zstrm_p->avail_out = buff_size;
+            int ret;
+            {
+                detail::stats_timer t(st.codec_ns);
+                ret = deflateParams(zstrm_p, new_level, Z_DEFAULT_STRATEGY);
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) throw Exception(zstrm_p, ret);
+            std::streamsize sz = reinterpret_cast< decltype(out_buff) >(zstrm_p->next_out) - out_buff;
+            if (sbuf_p->sputn(out_buff, sz) != sz) return -1;
+            if (ret == Z_OK) break;
+        }
+        // with write-behind, current_level() reads this from the caller's thread
+        if (wb_p) wb_p->locked([&] () { level = new_level; });
+        else level = new_level;
+        return 0;
+    }
+
+    std::streambuf * sbuf_p;
+    char * in_buff;
+    char * out_buff;
+    detail::z_stream_wrapper * zstrm_p;
+    detail::zstd_stream_wrapper * zstd_p;
+    detail::lz4_stream_wrapper * lz4_p;
+    detail::block_deflater * blk_p;
+    detail::write_behind * wb_p;
+    detail::stats_streambuf * io_p;
+    memory_profile mem;
+    std::size_t buff_size;
+    unsigned threads;
+    format fmt;
+    std::string dict;
+    bool allocated;
+    int level;
+    int min_level;
+    int max_level;
+    double target_mbps;
+    bool adaptive;
+    double deflate_time;
+    double sink_time;
+    stream_stats st;
+}; // class ostreambuf
+
+/// Block index of a BGZF file.
+///
+/// Holds the compressed and uncompressed offsets of the start of every block.
+/// The on-disk format is that of the .gzi files produced by `bgzip -i`: the
+/// number of entries, followed by the (compressed, uncompressed) offset pairs
+/// of all blocks but the first, all as little-endian 64-bit integers.
+class bgzf_index
+{
+public:
+    struct entry
+    {
+        std::uint64_t coffset;
+        std::uint64_t uoffset;
+    }; // struct entry
+
+    bgzf_index() : entry_v(1, entry{ 0, 0 }) {}
+
+    const std::vector< entry > & entries() const { return entry_v; }
+
+    void load(std::istream & is)
+    {
+        char buff[16];
+        if (not is.read(buff, 8)) throw Exception("zstr: invalid .gzi index");
+        std::uint64_t n = detail::get_le(buff, 8);
+        entry_v.assign(1, entry{ 0, 0 });
+        entry_v.reserve(n + 1);
+        for (std::uint64_t i = 0; i < n; ++i)
+        {
+            if (not is.read(buff, 16)) throw Exception("zstr: invalid .gzi index");
+            entry_v.push_back(entry{ detail::get_le(buff, 8), detail::get_le(buff + 8, 8) });
+        }
+    }
+
+    void save(std::ostream & os) const
+    {
+        char buff[16];
+        detail::put_le(buff, entry_v.size() - 1, 8);
+        os.write(buff, 8);
+        for (auto it = entry_v.begin() + 1; it != entry_v.end(); ++it)
+        {
+            detail::put_le(buff, it->coffset, 8);
+            detail::put_le(buff + 8, it->uoffset, 8);
+            os.write(buff, 16);
+        }
+    }
+
+    /// Build the index by scanning the block headers of a seekable BGZF
+    /// source, starting at offset 0. Only the headers and the ISIZE fields
+    /// are read; nothing is inflated.
+    void build(std::streambuf * sbuf_p)
+    {
+        entry_v.assign(1, entry{ 0, 0 });
+        std::uint64_t coffset = 0;
+        std::uint64_t uoffset = 0;
+        char buff[18];
+        while (true)
+        {
+            if (sbuf_p->pubseekpos(coffset, std::ios_base::in) != std::streampos(coffset))
+            {
+                throw Exception("zstr: BGZF index: seek failed");
+            }
+            std::streamsize sz = sbuf_p->sgetn(buff, 18);
+            if (sz == 0) break;
+            std::uint64_t bsize = block_size(buff, sz);
+            if (sbuf_p->pubseekpos(coffset + bsize - 4, std::ios_base::in) != std::streampos(coffset + bsize - 4)
+                or sbuf_p->sgetn(buff, 4) != 4)
+            {
+                throw Exception("zstr: truncated BGZF block");
+            }
+            coffset += bsize;
+            uoffset += detail::get_le(buff, 4);
+            if (sbuf_p->sgetc() == std::streambuf::traits_type::eof()) break;
+            entry_v.push_back(entry{ coffset, uoffset });
+        }
+    }
+
+    /// Virtual offset of the given uncompressed offset.
+    std::uint64_t virtual_offset(std::uint64_t uoffset) const
+    {
+        auto it = std::upper_bound(entry_v.begin(), entry_v.end(), uoffset,
+                                   [] (std::uint64_t u, const entry & e) { return u < e.uoffset; });
+        --it;
+        return (it->coffset << 16) | (uoffset - it->uoffset);
+    }
+
+    /// Uncompressed offset of the given virtual offset.
+    std::uint64_t uncompressed_offset(std::uint64_t voffset) const
+    {
+        auto it = std::lower_bound(entry_v.begin(), entry_v.end(), voffset >> 16,
+                                   [] (const entry & e, std::uint64_t c) { return e.coffset < c; });
+        if (it == entry_v.end() or it->coffset != (voffset >> 16))
+        {
+            throw Exception("zstr: BGZF index: no block at virtual offset");
+        }
+        return it->uoffset + (voffset & 0xFFFF);
+    }
+
+    /// Check the header of a BGZF block, and return the total block size.
+    static std::uint64_t block_size(const char * header, std::streamsize sz)
+    {
+        static const char magic[16] = {
+            '\x1F', '\x8B', 8, 4, 0, 0, 0, 0, 0, 0, 6, 0, 'B', 'C', 2, 0 };
+        if (sz < 18
+            or not std::equal(magic, magic + 4, header)
+            or not std::equal(magic + 10, magic + 16, header + 10))
+        {
+            throw Exception("zstr: invalid BGZF block header");
+        }
+        std::uint64_t bsize = detail::get_le(header + 16, 2) + 1;
+        if (bsize < 26) throw Exception("zstr: invalid BGZF block header");
+        return bsize;
+    }
+
+private:
+    std::vector< entry > entry_v;
+}; // class bgzf_index
+
+/// Random-access reader for BGZF data.
+///
+/// Positions are htslib-style virtual offsets: the compressed offset of a block
+/// shifted left by 16 bits, or-ed with an offset inside the uncompressed block.
+/// These are the values returned by tellg(), and accepted by seekg(); seeking
+/// requires a seekable source streambuf. With a block index, useek() and
+/// utell() work with uncompressed offsets, and reaching any of them requires
+/// inflating a single block.
+class bgzf_istreambuf
+    : public std::streambuf
+{
+public:
+    bgzf_istreambuf(std::streambuf * _sbuf_p)
+        : sbuf_p(_sbuf_p),
+          block_address(0),
+          next_block_address(0),
+          has_idx(false)
+    {
+        assert(sbuf_p);
+        in_buff = new char [max_block_size];
+        out_buff = new char [max_block_size];
+        setg(out_buff, out_buff, out_buff);
+        std::streamoff pos = sbuf_p->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+        if (pos > 0)
+        {
+            block_address = next_block_address = pos;
+        }
+    }
+
+    bgzf_istreambuf(const bgzf_istreambuf &) = delete;
+    bgzf_istreambuf & operator = (const bgzf_istreambuf &) = delete;
+
+    virtual ~bgzf_istreambuf()
+    {
+        delete [] in_buff;
+        delete [] out_buff;
+    }
+
+    virtual std::streambuf::int_type underflow()
+    {
+        while (this->gptr() == this->egptr())
+        {
+            if (not read_block()) return traits_type::eof();
+        }
+        return traits_type::to_int_type(*this->gptr());
+    }
+
+    virtual std::streambuf::pos_type seekoff(std::streambuf::off_type off, std::ios_base::seekdir dir,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        if (dir == std::ios_base::cur and off == 0)
+        {
+            return tell();
+        }
+        if (dir == std::ios_base::beg)
+        {
+            return seekpos(off, which);
+        }
+        return pos_type(off_type(-1));
+    }
+
+    virtual std::streambuf::pos_type seekpos(std::streambuf::pos_type sp,
+                                             std::ios_base::openmode which = std::ios_base::in)
+    {
+        if (not (which & std::ios_base::in)) return pos_type(off_type(-1));
+        std::uint64_t voffset = off_type(sp);
+        std::uint64_t coffset = voffset >> 16;
+        std::size_t uoffset = voffset & 0xFFFF;
+        if (coffset != block_address or this->egptr() == this->eback())
+        {
+            if (sbuf_p->pubseekpos(coffset, std::ios_base::in) != std::streampos(coffset))
+            {
+                return pos_type(off_type(-1));
+            }
+            next_block_address = coffset;
+            read_block();
+        }
+        if (uoffset > static_cast< std::size_t >(this->egptr() - this->eback())) return pos_type(off_type(-1));
+        this->setg(this->eback(), this->eback() + uoffset, this->egptr());
+        return sp;
+    }
+
+    /// Virtual offset of the current position.
+    std::uint64_t tell() const
+    {
+        return (block_address << 16) | static_cast< std::uint64_t >(this->gptr() - this->eback());
+    }
+
+    bool has_index() const { return has_idx; }
+    void set_index(const bgzf_index & _idx)
+    {
+        idx = _idx;
+        has_idx = true;
+    }
+    /// Return the block index, building it by scanning the source if none was set.
+    const bgzf_index & index()
+    {
+        if (not has_idx)
+        {
+            idx.build(sbuf_p);
+            has_idx = true;
+            sbuf_p->pubseekpos(next_block_address, std::ios_base::in);
+        }
+        return idx;
+    }
+
+    /// Seek to an uncompressed offset.
+    bool useek(std::uint64_t uoffset)
+    {
+        return seekpos(off_type(index().virtual_offset(uoffset))) != pos_type(off_type(-1));
+    }
+    /// Uncompressed offset of the current position.
+    std::uint64_t utell()
+    {
+        return index().uncompressed_offset(tell());
+    }
+
+    /// Maximum size of a BGZF block, compressed or not.
+    static const std::size_t max_block_size = (std::size_t)1 << 16;
+
+private:
+    // Read and inflate the next block. Return false at the end of the input.
+    bool read_block()
+    {
+        block_address = next_block_address;
+        this->setg(out_buff, out_buff, out_buff);
+        std::streamsize sz = sbuf_p->sgetn(in_buff, 18);
+        if (sz == 0) return false;
+        std::uint64_t bsize = bgzf_index::block_size(in_buff, sz);
+        if (sbuf_p->sgetn(in_buff + 18, bsize - 18) != static_cast< std::streamsize >(bsize - 18))
+        {
+            throw Exception("zstr: truncated BGZF block");
+        }
+        next_block_address += bsize;
+        std::size_t out_size = codec.decompress(in_buff + 18, bsize - 26, out_buff, max_block_size);
+        if (out_size != detail::get_le(in_buff + bsize - 4, 4)
+            or detail::block_codec::crc(0, out_buff, out_size) != detail::get_le(in_buff + bsize - 8, 4))
+        {
+            throw Exception("zstr: BGZF block checksum mismatch");
+        }
+        this->setg(out_buff, out_buff, out_buff + out_size);
+        return true;
+    }
+
+    std::streambuf * sbuf_p;
+    char * in_buff;
+    char * out_buff;
+    detail::block_codec codec;
+    std::uint64_t block_address;
+    std::uint64_t next_block_address;
+    bgzf_index idx;
+    bool has_idx;
+}; // class bgzf_istreambuf
+
+/// Container of keyed records, for lookups that inflate a single block.
+///
+/// Records are grouped into blocks of about _block_size bytes (a larger
+/// record gets a block of its own), each compressed independently as a gzip
+/// member. Then comes an uncompressed index, sorted by key, and a 32-byte
+/// footer:
+///
+///     entry:  block offset (8), key offset (8), key size (4), block size (4),
+///             record offset in the block (4), record size (4)
+///     index:  entries, followed by the keys
+///     footer: "ZSTRREC1", index offset (8), entry count (8), keys size (8)
+///
+/// Integers are little-endian. The blocks alone form an ordinary gzip file,
+/// so gunzip extracts the records (and complains about the trailing index).
+class record_writer
 {
 public:
-    istreambuf(std::streambuf * _sbuf_p,
-               std::size_t _buff_size = default_buff_size, bool _auto_detect = true)
+    static const std::size_t default_block_size = (std::size_t)1 << 16;
+
+    explicit record_writer(std::streambuf * _sbuf_p, std::size_t _block_size = default_block_size,
+                           int _level = Z_DEFAULT_COMPRESSION)
         : sbuf_p(_sbuf_p),
-          zstrm_p(nullptr),
-          buff_size(_buff_size),
-          auto_detect(_auto_detect),
-          auto_detect_run(false),
-          is_text(false)
+          codec(_level),
+          block_size(_block_size),
+          offset(0),
+          block_first_entry(0),
+          closed(false)
     {
         assert(sbuf_p);
-        in_buff = new char [buff_size];
-        in_buff_start = in_buff;
-        in_buff_end = in_buff;
-        out_buff = new char [buff_size];
-        setg(out_buff, out_buff, out_buff);
     }
 
-    istreambuf(const istreambuf &) = delete;
-    istreambuf(istreambuf &&) = default;
-    istreambuf & operator = (const istreambuf &) = delete;
-    istreambuf & operator = (istreambuf &&) = default;
+    record_writer(const record_writer &) = delete;
+    record_writer & operator = (const record_writer &) = delete;
 
-    virtual ~istreambuf()
+    /// Errors are ignored here: call close() to see them.
+    ~record_writer()
     {
-        delete [] in_buff;
-        delete [] out_buff;
-        if (zstrm_p) delete zstrm_p;
+        try
+        {
+            close();
+        }
+        catch (...) {}
     }
 
-    virtual std::streambuf::int_type underflow()
+    /// Add a record. With duplicate keys, lookups find the first one added.
+    void add(const std::string & key, const char * data, std::size_t size)
     {
-        if (this->gptr() == this->egptr())
+        assert(not closed);
+        if (size > 0xFFFFFFFF or key.size() > 0xFFFFFFFF) throw Exception("zstr: record_writer: record too large");
+        if (not block.empty() and block.size() + size > block_size) write_block();
+        entry_v.push_back(entry{ key, offset, 0, static_cast< std::uint32_t >(block.size()),
+                    static_cast< std::uint32_t >(size) });
+        block.append(data, size);
+        if (block.size() >= block_size) write_block();
+    }
+    void add(const std::string & key, const std::string & rec)
+    {
+        add(key, rec.data(), rec.size());
+    }
+
+    /// Write the last block, the index and the footer, and flush the sink.
+    void close()
+    {
+        if (closed) return;
+        closed = true;
+        if (not block.empty()) write_block();
+        std::stable_sort(entry_v.begin(), entry_v.end(),
+                         [] (const entry & lhs, const entry & rhs) { return lhs.key < rhs.key; });
+        std::string index;
+        std::uint64_t key_offset = 0;
+        char buff[32];
+        for (const auto & e : entry_v)
         {
-            // pointers for free region in output buffer
-            char * out_buff_free_start = out_buff;
-            do
-            {
-                // read more input if none available
-                if (in_buff_start == in_buff_end)
-                {
-                    // empty input buffer: refill from the start
-                    in_buff_start = in_buff;
-                    std::streamsize sz = sbuf_p->sgetn(in_buff, buff_size);
-                    in_buff_end = in_buff + sz;
-                    if (in_buff_end == in_buff_start) break; // end of input
-                }
-                // auto detect if the stream contains text or deflate data
-                if (auto_detect && ! auto_detect_run)
-                {
-                    auto_detect_run = true;
-                    unsigned char b0 = *reinterpret_cast< unsigned char * >(in_buff_start);
-                    unsigned char b1 = *reinterpret_cast< unsigned char * >(in_buff_start + 1);
-                    // Ref:
-                    // http://en.wikipedia.org/wiki/Gzip
-                    // http://stackoverflow.com/questions/9050260/what-does-a-zlib-header-look-like
-                    is_text = ! (in_buff_start + 2 <= in_buff_end
-                                 && ((b0 == 0x1F && b1 == 0x8B)         // gzip header
-                                     || (b0 == 0x78 && (b1 == 0x01      // zlib header
-                                                        || b1 == 0x9C
-                                                        || b1 == 0xDA))));
-                }
-                if (is_text)
-                {
-                    // simply swap in_buff and out_buff, and adjust pointers
-                    assert(in_buff_start == in_buff);
-                    std::swap(in_buff, out_buff);
-                    out_buff_free_start = in_buff_end;
-                    in_buff_start = in_buff;
-                    in_buff_end = in_buff;
-                }
-                else
-                {
-                    // run inflate() on input
-                    if (! zstrm_p) zstrm_p = new detail::z_stream_wrapper(true);
-                    zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(in_buff_start);
-                    zstrm_p->avail_in = in_buff_end - in_buff_start;
-                    zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out_buff_free_start);
-                    zstrm_p->avail_out = (out_buff + buff_size) - out_buff_free_start;
-                    int ret = inflate(zstrm_p, Z_NO_FLUSH);
-                    // process return code
-                    if (ret != Z_OK && ret != Z_STREAM_END) throw Exception(zstrm_p, ret);
-                    // update in&out pointers following inflate()
-                    in_buff_start = reinterpret_cast< decltype(in_buff_start) >(zstrm_p->next_in);
-                    in_buff_end = in_buff_start + zstrm_p->avail_in;
-                    out_buff_free_start = reinterpret_cast< decltype(out_buff_free_start) >(zstrm_p->next_out);
-                    assert(out_buff_free_start + zstrm_p->avail_out == out_buff + buff_size);
-                    // if stream ended, deallocate inflator
-                    if (ret == Z_STREAM_END)
-                    {
-                        delete zstrm_p;
-                        zstrm_p = nullptr;
-                    }
-                }
-            } while (out_buff_free_start == out_buff);
-            // 2 exit conditions:
-            // - end of input: there might or might not be output available
-            // - out_buff_free_start != out_buff: output available
-            this->setg(out_buff, out_buff, out_buff_free_start);
+            detail::put_le(buff, e.block_offset, 8);
+            detail::put_le(buff + 8, key_offset, 8);
+            detail::put_le(buff + 16, e.key.size(), 4);
+            detail::put_le(buff + 20, e.block_size, 4);
+            detail::put_le(buff + 24, e.rec_offset, 4);
+            detail::put_le(buff + 28, e.rec_size, 4);
+            index.append(buff, 32);
+            key_offset += e.key.size();
         }
-        return this->gptr() == this->egptr()
-            ? traits_type::eof()
-            : traits_type::to_int_type(*this->gptr());
+        for (const auto & e : entry_v) index += e.key;
+        std::copy(magic(), magic() + 8, buff);
+        detail::put_le(buff + 8, offset, 8);
+        detail::put_le(buff + 16, entry_v.size(), 8);
+        detail::put_le(buff + 24, key_offset, 8);
+        index.append(buff, 32);
+        write(index.data(), index.size());
+        entry_v.clear();
+        if (sbuf_p->pubsync() != 0) throw Exception("zstr: record_writer: write error");
     }
+
+    /// The first 8 bytes of the footer.
+    static const char * magic() { return "ZSTRREC1"; }
+
 private:
-    std::streambuf * sbuf_p;
-    char * in_buff;
-    char * in_buff_start;
-    char * in_buff_end;
-    char * out_buff;
-    detail::z_stream_wrapper * zstrm_p;
-    std::size_t buff_size;
-    bool auto_detect;
-    bool auto_detect_run;
-    bool is_text;
+    struct entry
+    {
+        std::string key;
+        std::uint64_t block_offset;
+        std::uint32_t block_size;
+        std::uint32_t rec_offset;
+        std::uint32_t rec_size;
+    }; // struct entry
 
-    static const std::size_t default_buff_size = (std::size_t)1 << 20;
-}; // class istreambuf
+    // Compress the current block as a gzip member, and write it out.
+    void write_block()
+    {
+        if (block.size() > 0xFFFFFFFF) throw Exception("zstr: record_writer: block too large");
+        // gzip header: magic, deflate method, no flags, no mtime, unknown xfl, Unix OS
+        static const char header[10] = { '\x1F', '\x8B', 8, 0, 0, 0, 0, 0, 0, 3 };
+        out.resize(10 + codec.bound(block.size()) + 8);
+        std::copy(header, header + 10, &out[0]);
+        std::size_t sz = 10 + codec.compress(block.data(), block.size(), &out[10], out.size() - 18);
+        detail::put_le(&out[sz], detail::block_codec::crc(0, block.data(), block.size()), 4);
+        detail::put_le(&out[sz + 4], block.size(), 4);
+        sz += 8;
+        if (sz > 0xFFFFFFFF) throw Exception("zstr: record_writer: block too large");
+        for (std::size_t i = block_first_entry; i < entry_v.size(); ++i)
+        {
+            entry_v[i].block_size = sz;
+        }
+        write(out.data(), sz);
+        block.clear();
+        block_first_entry = entry_v.size();
+    }
 
-class ostreambuf
-    : public std::streambuf
+    void write(const char * data, std::size_t size)
+    {
+        if (sbuf_p->sputn(data, size) != static_cast< std::streamsize >(size))
+        {
+            throw Exception("zstr: record_writer: write error");
+        }
+        offset += size;
+    }
+
+    std::streambuf * sbuf_p;
+    detail::block_codec codec;
+    std::size_t block_size;
+    std::uint64_t offset;
+    std::string block;
+    std::string out;
+    std::vector< entry > entry_v;
+    std::size_t block_first_entry;
+    bool closed;
+}; // class record_writer
+
+/// Reader of a record_writer container, from a seekable streambuf.
+///
+/// The index is loaded on construction. With an mmap_streambuf source, the
+/// index and the blocks are used in place, from the mapping: opening a large
+/// container is then cheap, and only the pages that lookups touch are read.
+/// A lookup inflates exactly one block; the last block inflated is kept, for
+/// lookups of nearby keys.
+class record_reader
 {
 public:
-    ostreambuf(std::streambuf * _sbuf_p,
-               std::size_t _buff_size = default_buff_size, int _level = Z_DEFAULT_COMPRESSION)
+    explicit record_reader(std::streambuf * _sbuf_p)
         : sbuf_p(_sbuf_p),
-          zstrm_p(new detail::z_stream_wrapper(false, _level)),
-          buff_size(_buff_size)
+          src_p(dynamic_cast< mmap_streambuf * >(_sbuf_p)),
+          index_p(nullptr),
+          n_entries(0),
+          keys_p(nullptr),
+          keys_size(0),
+          index_offset(0),
+          cached_offset(-1)
     {
         assert(sbuf_p);
-        in_buff = new char [buff_size];
-        out_buff = new char [buff_size];
-        setp(in_buff, in_buff + buff_size);
+        std::streampos end = sbuf_p->pubseekoff(0, std::ios_base::end, std::ios_base::in);
+        if (end == std::streampos(-1) or end < 32) throw Exception("zstr: record_reader: not a record container");
+        std::uint64_t file_size = end;
+        char footer[32];
+        read(file_size - 32, 32, footer);
+        if (not std::equal(footer, footer + 8, record_writer::magic()))
+        {
+            throw Exception("zstr: record_reader: not a record container");
+        }
+        index_offset = detail::get_le(footer + 8, 8);
+        n_entries = detail::get_le(footer + 16, 8);
+        keys_size = detail::get_le(footer + 24, 8);
+        if (index_offset > file_size - 32 or n_entries > (file_size - 32 - index_offset) / 32
+            or keys_size != file_size - 32 - index_offset - 32 * n_entries)
+        {
+            throw Exception("zstr: record_reader: invalid index");
+        }
+        std::size_t index_size = 32 * n_entries + keys_size;
+        if (src_p)
+        {
+            index_p = take(index_offset, index_size);
+        }
+        else
+        {
+            index_buff.resize(index_size);
+            read(index_offset, index_size, &index_buff[0]);
+            index_p = index_buff.data();
+        }
+        keys_p = index_p + 32 * n_entries;
     }
 
-    ostreambuf(const ostreambuf &) = delete;
-    ostreambuf(ostreambuf &&) = default;
-    ostreambuf & operator = (const ostreambuf &) = delete;
-    ostreambuf & operator = (ostreambuf &&) = default;
+    record_reader(const record_reader &) = delete;
+    record_reader & operator = (const record_reader &) = delete;
 
-    int deflate_loop(int flush)
+    /// Number of records.
+    std::size_t size() const { return n_entries; }
+
+    /// Look up a record by key. Return false if the key is not present.
+    bool find(const std::string & key, std::string & rec)
     {
-        while (true)
+        std::uint64_t lo = 0;
+        std::uint64_t hi = n_entries;
+        while (lo < hi)
         {
-            zstrm_p->next_out = reinterpret_cast< decltype(zstrm_p->next_out) >(out_buff);
-            zstrm_p->avail_out = buff_size;
-            int ret = deflate(zstrm_p, flush);
-            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) throw Exception(zstrm_p, ret);
-            std::streamsize sz = sbuf_p->sputn(out_buff, reinterpret_cast< decltype(out_buff) >(zstrm_p->next_out) - out_buff);
-            if (sz != reinterpret_cast< decltype(out_buff) >(zstrm_p->next_out) - out_buff)
-            {
-                // there was an error in the sink stream
-                return -1;
-            }
-            if (ret == Z_STREAM_END || ret == Z_BUF_ERROR || sz == 0)
-            {
-                break;
-            }
+            std::uint64_t mid = lo + (hi - lo) / 2;
+            if (compare_key(mid, key) < 0) lo = mid + 1;
+            else hi = mid;
         }
-        return 0;
+        if (lo == n_entries or compare_key(lo, key) != 0) return false;
+        const char * e = index_p + 32 * lo;
+        std::uint64_t rec_offset = detail::get_le(e + 24, 4);
+        std::uint64_t rec_size = detail::get_le(e + 28, 4);
+        const std::string & blk = load_block(detail::get_le(e, 8), detail::get_le(e + 20, 4));
+        if (rec_offset + rec_size > blk.size()) throw Exception("zstr: record_reader: invalid index");
+        rec.assign(blk, rec_offset, rec_size);
+        return true;
     }
 
-    virtual ~ostreambuf()
+private:
+    // Compare the key of entry i to key, in place, as std::string::compare().
+    int compare_key(std::uint64_t i, const std::string & key) const
     {
-        // flush the zlib stream
-        //
-        // NOTE: Errors here (sync() return value not 0) are ignored, because we
-        // cannot throw in a destructor. This mirrors the behaviour of
-        // std::basic_filebuf::~basic_filebuf(). To see an exception on error,
-        // close the ofstream with an explicit call to close(), and do not rely
-        // on the implicit call in the destructor.
-        //
-        sync();
-        delete [] in_buff;
-        delete [] out_buff;
-        delete zstrm_p;
+        const char * e = index_p + 32 * i;
+        std::uint64_t key_offset = detail::get_le(e + 8, 8);
+        std::uint64_t key_len = detail::get_le(e + 16, 4);
+        if (key_offset > keys_size or key_len > keys_size - key_offset)
+        {
+            throw Exception("zstr: record_reader: invalid index");
+        }
+        int res = std::memcmp(keys_p + key_offset, key.data(), std::min< std::uint64_t >(key_len, key.size()));
+        if (res != 0) return res;
+        return key_len < key.size()? -1 : key_len > key.size()? 1 : 0;
     }
-    virtual std::streambuf::int_type overflow(std::streambuf::int_type c = traits_type::eof())
+
+    // Inflate the block at the given offset, unless it is the cached one.
+    const std::string & load_block(std::uint64_t offset, std::size_t size)
     {
-        zstrm_p->next_in = reinterpret_cast< decltype(zstrm_p->next_in) >(pbase());
-        zstrm_p->avail_in = pptr() - pbase();
-        while (zstrm_p->avail_in > 0)
+        if (offset == cached_offset) return block;
+        cached_offset = -1;
+        // blocks come before the index
+        if (offset > index_offset or size > index_offset - offset)
         {
-            int r = deflate_loop(Z_NO_FLUSH);
-            if (r != 0)
-            {
-                setp(nullptr, nullptr);
-                return traits_type::eof();
-            }
+            throw Exception("zstr: record_reader: invalid index");
         }
-        setp(in_buff, in_buff + buff_size);
-        return traits_type::eq_int_type(c, traits_type::eof()) ? traits_type::eof() : sputc(c);
+        const char * p;
+        if (src_p)
+        {
+            p = take(offset, size);
+        }
+        else
+        {
+            in.resize(size);
+            read(offset, size, &in[0]);
+            p = in.data();
+        }
+        if (size < 18 or p[0] != '\x1F' or p[1] != '\x8B' or p[3] != 0)
+        {
+            throw Exception("zstr: record_reader: invalid block");
+        }
+        // deflate expands by at most 1032:1, so a larger ISIZE is corrupt
+        std::uint64_t isize = detail::get_le(p + size - 4, 4);
+        if (isize / 1032 > size - 18) throw Exception("zstr: record_reader: invalid block");
+        block.resize(isize);
+        if (codec.decompress(p + 10, size - 18, &block[0], block.size()) != block.size()
+            or detail::block_codec::crc(0, block.data(), block.size()) != detail::get_le(p + size - 8, 4))
+        {
+            throw Exception("zstr: record_reader: block checksum mismatch");
+        }
+        cached_offset = offset;
+        return block;
     }
-    virtual int sync()
+
+    void read(std::uint64_t offset, std::size_t size, char * data)
     {
-        // first, call overflow to clear in_buff
-        overflow();
-        if (! pptr()) return -1;
-        // then, call deflate asking to finish the zlib stream
-        zstrm_p->next_in = nullptr;
-        zstrm_p->avail_in = 0;
-        if (deflate_loop(Z_FINISH) != 0) return -1;
-        deflateReset(zstrm_p);
-        return 0;
+        if (sbuf_p->pubseekpos(offset, std::ios_base::in) != std::streampos(offset)
+            or sbuf_p->sgetn(data, size) != static_cast< std::streamsize >(size))
+        {
+            throw Exception("zstr: record_reader: read error");
+        }
     }
-private:
-    std::streambuf * sbuf_p;
-    char * in_buff;
-    char * out_buff;
-    detail::z_stream_wrapper * zstrm_p;
-    std::size_t buff_size;
 
-    static const std::size_t default_buff_size = (std::size_t)1 << 20;
-}; // class ostreambuf
+    const char * take(std::uint64_t offset, std::size_t size)
+    {
+        char * p;
+        if (sbuf_p->pubseekpos(offset, std::ios_base::in) != std::streampos(offset)
+            or src_p->take(p, size) != size)
+        {
+            throw Exception("zstr: record_reader: read error");
+        }
+        return p;
+    }
+
+    std::streambuf * sbuf_p;
+    mmap_streambuf * src_p;
+    detail::block_codec codec;
+    std::string index_buff;
+    const char * index_p;
+    std::uint64_t n_entries;
+    const char * keys_p;
+    std::uint64_t keys_size;
+    std::uint64_t index_offset;
+    std::string in;
+    std::string block;
+    std::uint64_t cached_offset;
+}; // class record_reader
 
 class istream
     : public std::istream
 {
 public:
-    istream(std::istream & is)
-        : std::istream(new istreambuf(is.rdbuf()))
+    istream(std::istream & is, unsigned threads = 0)
+        : std::istream(new istreambuf(is.rdbuf(), istreambuf::default_buff_size, true, threads))
     {
         exceptions(std::ios_base::badbit);
     }
-    explicit istream(std::streambuf * sbuf_p)
-        : std::istream(new istreambuf(sbuf_p))
+    explicit istream(std::streambuf * sbuf_p, unsigned threads = 0)
+        : std::istream(new istreambuf(sbuf_p, istreambuf::default_buff_size, true, threads))
     {
         exceptions(std::ios_base::badbit);
     }
@@ -342,13 +4549,13 @@ class ostream
     : public std::ostream
 {
 public:
-    ostream(std::ostream & os)
-        : std::ostream(new ostreambuf(os.rdbuf()))
+    ostream(std::ostream & os, unsigned threads = 0, format fmt = format::gzip)
+        : std::ostream(new ostreambuf(os.rdbuf(), ostreambuf::default_buff_size, Z_DEFAULT_COMPRESSION, threads, fmt))
     {
         exceptions(std::ios_base::badbit);
     }
-    explicit ostream(std::streambuf * sbuf_p)
-        : std::ostream(new ostreambuf(sbuf_p))
+    explicit ostream(std::streambuf * sbuf_p, unsigned threads = 0, format fmt = format::gzip)
+        : std::ostream(new ostreambuf(sbuf_p, ostreambuf::default_buff_size, Z_DEFAULT_COMPRESSION, threads, fmt))
     {
         exceptions(std::ios_base::badbit);
     }
@@ -364,22 +4571,58 @@ namespace detail
 template < typename FStream_Type >
 struct strict_fstream_holder
 {
-    strict_fstream_holder(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in)
-        : _fs(filename, mode)
-    {}
+    // Without do_open, _fs is left closed, e.g. for a memory-mapped file.
+    strict_fstream_holder(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in,
+                          bool do_open = true)
+    {
+        if (do_open) _fs.open(filename, mode);
+    }
     FStream_Type _fs;
 }; // class strict_fstream_holder
 
+struct mmap_holder
+{
+    mmap_holder(const std::string& filename, bool use_mmap)
+        : _mm_p(nullptr)
+    {
+        if (not use_mmap) return;
+        try
+        {
+            _mm_p = new mmap_streambuf(filename);
+        }
+        catch (Exception &)
+        {
+            // not mappable (e.g. a pipe): read through the filebuf instead
+        }
+    }
+    ~mmap_holder() { delete _mm_p; }
+    mmap_streambuf * _mm_p;
+}; // struct mmap_holder
+
 } // namespace detail
 
 class ifstream
-    : private detail::strict_fstream_holder< strict_fstream::ifstream >,
+    : private detail::mmap_holder,
+      private detail::strict_fstream_holder< strict_fstream::ifstream >,
       public std::istream
 {
 public:
-    explicit ifstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in)
-        : detail::strict_fstream_holder< strict_fstream::ifstream >(filename, mode),
-          std::istream(new istreambuf(_fs.rdbuf()))
+    /// With use_mmap, local files are memory-mapped and read in place; the
+    /// file is only opened as a stream if it cannot be mapped.
+    explicit ifstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in,
+                      unsigned threads = 0, bool use_mmap = false)
+        : detail::mmap_holder(filename, use_mmap),
+          detail::strict_fstream_holder< strict_fstream::ifstream >(filename, mode, not _mm_p),
+          std::istream(new istreambuf(source(), istreambuf::default_buff_size, true, threads))
+    {
+        exceptions(std::ios_base::badbit);
+    }
+    /// Use the given memory profile, see istreambuf.
+    ifstream(const std::string& filename, const memory_profile & mem,
+             std::ios_base::openmode mode = std::ios_base::in, unsigned threads = 0, bool use_mmap = false)
+        : detail::mmap_holder(filename, use_mmap),
+          detail::strict_fstream_holder< strict_fstream::ifstream >(filename, mode, not _mm_p),
+          std::istream(new istreambuf(source(), mem, true, threads))
     {
         exceptions(std::ios_base::badbit);
     }
@@ -387,6 +4630,33 @@ public:
     {
         if (rdbuf()) delete rdbuf();
     }
+
+    /// See istreambuf::record_index().
+    void record_index(gzip_index * idx_p, std::uint64_t span = istreambuf::default_index_span)
+    {
+        static_cast< istreambuf * >(rdbuf())->record_index(idx_p, span);
+    }
+    /// See istreambuf::set_index().
+    void set_index(const gzip_index & idx)
+    {
+        static_cast< istreambuf * >(rdbuf())->set_index(idx);
+    }
+    /// See istreambuf::set_dictionary().
+    void set_dictionary(const std::string & dict)
+    {
+        static_cast< istreambuf * >(rdbuf())->set_dictionary(dict);
+    }
+    /// See istreambuf::stats().
+    const stream_stats & stats() const
+    {
+        return static_cast< istreambuf * >(rdbuf())->stats();
+    }
+
+private:
+    std::streambuf * source()
+    {
+        return _mm_p? static_cast< std::streambuf * >(_mm_p) : _fs.rdbuf();
+    }
 }; // class ifstream
 
 class ofstream
@@ -394,9 +4664,18 @@ class ofstream
       public std::ostream
 {
 public:
-    explicit ofstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::out)
+    explicit ofstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::out,
+                      unsigned threads = 0, format fmt = format::gzip)
+        : detail::strict_fstream_holder< strict_fstream::ofstream >(filename, mode | std::ios_base::binary),
+          std::ostream(new ostreambuf(_fs.rdbuf(), ostreambuf::default_buff_size, Z_DEFAULT_COMPRESSION, threads, fmt))
+    {
+        exceptions(std::ios_base::badbit);
+    }
+    /// Use the given memory profile, see ostreambuf.
+    ofstream(const std::string& filename, const memory_profile & mem,
+             std::ios_base::openmode mode = std::ios_base::out, unsigned threads = 0, format fmt = format::gzip)
         : detail::strict_fstream_holder< strict_fstream::ofstream >(filename, mode | std::ios_base::binary),
-          std::ostream(new ostreambuf(_fs.rdbuf()))
+          std::ostream(new ostreambuf(_fs.rdbuf(), mem, Z_DEFAULT_COMPRESSION, threads, fmt))
     {
         exceptions(std::ios_base::badbit);
     }
@@ -404,8 +4683,81 @@ public:
     {
         if (rdbuf()) delete rdbuf();
     }
+
+    /// See ostreambuf::set_write_behind().
+    void set_write_behind(unsigned depth = 2)
+    {
+        static_cast< ostreambuf * >(rdbuf())->set_write_behind(depth);
+    }
+    /// See ostreambuf::set_dictionary().
+    void set_dictionary(const std::string & dict)
+    {
+        static_cast< ostreambuf * >(rdbuf())->set_dictionary(dict);
+    }
+    /// See ostreambuf::stats().
+    const stream_stats & stats() const
+    {
+        return static_cast< ostreambuf * >(rdbuf())->stats();
+    }
 }; // class ofstream
 
+class bgzf_ifstream
+    : private detail::strict_fstream_holder< strict_fstream::ifstream >,
+      public std::istream
+{
+public:
+    /// If present, the block index is loaded from filename + ".gzi" the first
+    /// time it is needed; otherwise, it is built by scanning the file.
+    explicit bgzf_ifstream(const std::string& filename, std::ios_base::openmode mode = std::ios_base::in)
+        : detail::strict_fstream_holder< strict_fstream::ifstream >(filename, mode | std::ios_base::binary),
+          std::istream(new bgzf_istreambuf(_fs.rdbuf())),
+          index_file(filename + ".gzi")
+    {
+        exceptions(std::ios_base::badbit);
+    }
+    virtual ~bgzf_ifstream()
+    {
+        if (rdbuf()) delete rdbuf();
+    }
+
+    const bgzf_index & index()
+    {
+        bgzf_istreambuf * sbuf_p = static_cast< bgzf_istreambuf * >(rdbuf());
+        if (not sbuf_p->has_index())
+        {
+            std::ifstream ifs(index_file, std::ios_base::in | std::ios_base::binary);
+            if (ifs)
+            {
+                bgzf_index idx;
+                idx.load(ifs);
+                sbuf_p->set_index(idx);
+            }
+        }
+        return sbuf_p->index();
+    }
+
+    /// Seek to an uncompressed offset.
+    bgzf_ifstream & useek(std::uint64_t uoffset)
+    {
+        clear(rdstate() & ~std::ios_base::eofbit);
+        if (not fail())
+        {
+            index();
+            if (not static_cast< bgzf_istreambuf * >(rdbuf())->useek(uoffset)) setstate(std::ios_base::failbit);
+        }
+        return *this;
+    }
+    /// Uncompressed offset of the current position.
+    std::uint64_t utell()
+    {
+        if (fail()) return std::uint64_t(-1);
+        index();
+        return static_cast< bgzf_istreambuf * >(rdbuf())->utell();
+    }
+private:
+    std::string index_file;
+}; // class bgzf_ifstream
+
 } // namespace zstr
 
 #endif